@@ -62,14 +62,16 @@ int twc_bootstrap_count = sizeof(twc_bootstrap_addresses)
 
 /**
  * Bootstrap a Tox object with a DHT bootstrap node. Returns the result of
- * tox_bootstrap_from_address.
+ * tox_bootstrap, or 0 if public_key is not a valid hex public key.
  */
 int
 twc_bootstrap_tox(Tox *tox, const char *address, uint16_t port,
                   const char *public_key)
 {
-    uint8_t binary_key[TOX_ADDRESS_SIZE];
-    twc_hex2bin(public_key, TOX_ADDRESS_SIZE, binary_key);
+    uint8_t binary_key[TOX_PUBLIC_KEY_SIZE];
+    if (twc_hex2bin(public_key, TOX_PUBLIC_KEY_SIZE, binary_key)
+        != TOX_PUBLIC_KEY_SIZE * 2)
+        return 0;
     TOX_ERR_BOOTSTRAP err;
 
     int result = tox_bootstrap(tox, address, port,
@@ -19,14 +19,18 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include <weechat/weechat-plugin.h>
 #include <tox/tox.h>
 
 #include "twc.h"
 #include "twc-list.h"
+#include "twc-key-map.h"
 #include "twc-profile.h"
 #include "twc-message-queue.h"
+#include "twc-roster.h"
+#include "twc-worker.h"
 #include "twc-utils.h"
 
 #include "twc-chat.h"
@@ -35,6 +39,13 @@ const char *twc_tag_unsent_message = "tox_unsent";
 const char *twc_tag_sent_message = "tox_sent";
 const char *twc_tag_received_message = "tox_received";
 
+/**
+ * Prefix of the tag identifying the line of a queued message.
+ */
+#define TWC_CHAT_MESSAGE_TAG "tox_message_"
+
+struct t_hashtable *twc_chat_buffers = NULL;
+
 int
 twc_chat_buffer_input_callback(void *data,
                                struct t_gui_buffer *weechat_buffer,
@@ -44,22 +55,15 @@ twc_chat_buffer_close_callback(void *data,
                                struct t_gui_buffer *weechat_buffer);
 
 /**
- * Hash a Tox ID for the nicklist hashtable in group chat objects.
+ * Initialize the buffer to chat index.
  */
-unsigned long long
-twc_tox_id_hash_callback(struct t_hashtable *hashtable, const void *key)
-{
-    return twc_hash_tox_id(key);
-}
-
-/**
- * Compare two Tox IDs for the nicklist hashtable in group chat objects.
- */
-int
-twc_tox_id_compare_callback(struct t_hashtable *hashtable,
-                            const void *id1, const void *id2)
+void
+twc_chat_init()
 {
-    return memcmp(id1, id2, TOX_PUBLIC_KEY_SIZE);
+    twc_chat_buffers = weechat_hashtable_new(32,
+                                             WEECHAT_HASHTABLE_POINTER,
+                                             WEECHAT_HASHTABLE_POINTER,
+                                             NULL, NULL);
 }
 
 /**
@@ -75,6 +79,18 @@ twc_chat_new(struct t_twc_profile *profile, const char *name)
     chat->profile = profile;
     chat->friend_number = chat->group_number = -1;
     chat->nicks = NULL;
+    chat->short_name = chat->title = NULL;
+    chat->refresh_queued = false;
+    chat->next_dirty_chat = NULL;
+    chat->unsent_lines = weechat_hashtable_new(32,
+                                               WEECHAT_HASHTABLE_STRING,
+                                               WEECHAT_HASHTABLE_POINTER,
+                                               NULL, NULL);
+    if (!chat->unsent_lines)
+    {
+        free(chat);
+        return NULL;
+    }
 
     size_t full_name_size = strlen(profile->name) + 1 + strlen(name) + 1;
     char *full_name = malloc(full_name_size);
@@ -86,12 +102,14 @@ twc_chat_new(struct t_twc_profile *profile, const char *name)
 
     if (!(chat->buffer))
     {
+        weechat_hashtable_free(chat->unsent_lines);
         free(chat);
         return NULL;
     }
 
+    twc_list_add(profile->chats, &chat->list_item);
     twc_chat_queue_refresh(chat);
-    twc_list_item_new_data_add(profile->chats, chat);
+    weechat_hashtable_set(twc_chat_buffers, chat->buffer, chat);
 
     return chat;
 }
@@ -113,7 +131,10 @@ twc_chat_new_friend(struct t_twc_profile *profile, int32_t friend_number)
 
     struct t_twc_chat *chat = twc_chat_new(profile, buffer_name);
     if (chat)
+    {
         chat->friend_number = friend_number;
+        weechat_hashtable_set(profile->friend_chats, &friend_number, chat);
+    }
 
     return chat;
 }
@@ -131,14 +152,11 @@ twc_chat_new_group(struct t_twc_profile *profile, int32_t group_number)
     if (chat)
     {
         chat->group_number = group_number;
+        weechat_hashtable_set(profile->group_chats, &group_number, chat);
 
         chat->nicklist_group = weechat_nicklist_add_group(chat->buffer, NULL,
                                                           NULL, NULL, true);
-        chat->nicks = weechat_hashtable_new(32,
-                                            WEECHAT_HASHTABLE_BUFFER,
-                                            WEECHAT_HASHTABLE_POINTER,
-                                            twc_tox_id_hash_callback,
-                                            twc_tox_id_compare_callback);
+        chat->nicks = twc_key_map_new(32);
 
         weechat_buffer_set(chat->buffer, "nicklist", "1");
     }
@@ -146,20 +164,36 @@ twc_chat_new_group(struct t_twc_profile *profile, int32_t group_number)
     return chat;
 }
 
+/**
+ * Set a buffer property, unless it already has that value. cache holds the
+ * value last set.
+ */
+void
+twc_chat_set_buffer_string(struct t_twc_chat *chat, const char *property,
+                           char **cache, const char *value)
+{
+    if (*cache && strcmp(*cache, value) == 0)
+        return;
+
+    free(*cache);
+    *cache = strdup(value);
+    weechat_buffer_set(chat->buffer, property, value);
+}
+
 /**
  * Refresh a chat. Updates buffer short_name and title.
  */
 void
 twc_chat_refresh(struct t_twc_chat *chat)
 {
-    char *name = NULL;
-    char *title = NULL;
     if (chat->friend_number >= 0)
     {
-        name = twc_get_name_nt(chat->profile->tox,
-                               chat->friend_number);
-        title = twc_get_status_message_nt(chat->profile->tox,
-                                          chat->friend_number);
+        twc_chat_set_buffer_string(chat, "short_name", &chat->short_name,
+                                   twc_roster_name(chat->profile,
+                                                   chat->friend_number));
+        twc_chat_set_buffer_string(chat, "title", &chat->title,
+                                   twc_roster_status_message(chat->profile,
+                                                             chat->friend_number));
     }
     else if (chat->group_number >= 0)
     {
@@ -170,38 +204,58 @@ twc_chat_refresh(struct t_twc_chat *chat)
         if (len <= 0)
             sprintf(group_name, "Group Chat %d", chat->group_number);
 
-        name = title = strdup((char *)group_name);
+        twc_chat_set_buffer_string(chat, "short_name", &chat->short_name,
+                                   group_name);
+        twc_chat_set_buffer_string(chat, "title", &chat->title, group_name);
     }
-
-    weechat_buffer_set(chat->buffer, "short_name", name);
-    weechat_buffer_set(chat->buffer, "title", title);
-
-    if (name)
-        free(name);
-    if (title && title != name)
-        free(title);
 }
 
 /**
- * Callback for twc_chat_queue_refresh. Simply calls twc_chat_refresh.
+ * Callback for twc_chat_queue_refresh. Refreshes all chats of a profile
+ * that have been queued since the last tick.
  */
 int
 twc_chat_refresh_timer_callback(void *data, int remaining)
 {
-    twc_chat_refresh(data);
+    struct t_twc_profile *profile = data;
+    profile->chat_refresh_timer = NULL;
+
+    twc_worker_lock(profile);
+    struct t_twc_chat *chat = profile->dirty_chats;
+    profile->dirty_chats = NULL;
+    while (chat)
+    {
+        struct t_twc_chat *next_chat = chat->next_dirty_chat;
+        chat->next_dirty_chat = NULL;
+        chat->refresh_queued = false;
+        twc_chat_refresh(chat);
+        chat = next_chat;
+    }
+    twc_worker_unlock(profile);
 
     return WEECHAT_RC_OK;
 }
 
 /**
  * Queue a refresh of the buffer in 1ms (i.e. the next event loop tick). Done
- * this way to allow data to update before refreshing interface.
+ * this way to allow data to update before refreshing interface. Refreshes
+ * queued in the same tick share one timer, and each chat is refreshed once.
  */
 void
 twc_chat_queue_refresh(struct t_twc_chat *chat)
 {
-    weechat_hook_timer(1, 0, 1,
-                       twc_chat_refresh_timer_callback, chat);
+    if (chat->refresh_queued)
+        return;
+
+    struct t_twc_profile *profile = chat->profile;
+    chat->refresh_queued = true;
+    chat->next_dirty_chat = profile->dirty_chats;
+    profile->dirty_chats = chat;
+
+    if (!profile->chat_refresh_timer)
+        profile->chat_refresh_timer =
+            weechat_hook_timer(1, 0, 1,
+                               twc_chat_refresh_timer_callback, profile);
 }
 
 /**
@@ -212,13 +266,10 @@ struct t_twc_chat *
 twc_chat_search_friend(struct t_twc_profile *profile,
                        int32_t friend_number, bool create_new)
 {
-    size_t index;
-    struct t_twc_list_item *item;
-    twc_list_foreach(profile->chats, index, item)
-    {
-        if (item->chat->friend_number == friend_number)
-            return item->chat;
-    }
+    struct t_twc_chat *chat = weechat_hashtable_get(profile->friend_chats,
+                                                    &friend_number);
+    if (chat)
+        return chat;
 
     if (create_new)
         return twc_chat_new_friend(profile, friend_number);
@@ -227,20 +278,17 @@ twc_chat_search_friend(struct t_twc_profile *profile,
 }
 
 /**
- * Find an existing chat object for a friend, and if not found, optionally
+ * Find an existing chat object for a group chat, and if not found, optionally
  * create a new one.
  */
 struct t_twc_chat *
 twc_chat_search_group(struct t_twc_profile *profile,
                       int32_t group_number, bool create_new)
 {
-    size_t index;
-    struct t_twc_list_item *item;
-    twc_list_foreach(profile->chats, index, item)
-    {
-        if (item->chat->group_number == group_number)
-            return item->chat;
-    }
+    struct t_twc_chat *chat = weechat_hashtable_get(profile->group_chats,
+                                                    &group_number);
+    if (chat)
+        return chat;
 
     if (create_new)
         return twc_chat_new_group(profile, group_number);
@@ -254,21 +302,7 @@ twc_chat_search_group(struct t_twc_profile *profile,
 struct t_twc_chat *
 twc_chat_search_buffer(struct t_gui_buffer *buffer)
 {
-    size_t profile_index;
-    struct t_twc_list_item *profile_item;
-    twc_list_foreach(twc_profiles, profile_index, profile_item)
-    {
-        size_t chat_index;
-        struct t_twc_list_item *chat_item;
-        twc_list_foreach(profile_item->profile->chats, chat_index, chat_item)
-        {
-            if (chat_item->chat->buffer == buffer)
-            {
-                return chat_item->chat;
-            }
-        }
-    }
-    return NULL;
+    return weechat_hashtable_get(twc_chat_buffers, buffer);
 }
 
 /**
@@ -306,12 +340,68 @@ twc_chat_send_message(struct t_twc_chat *chat, const char *message,
 {
     if (chat->friend_number >= 0)
     {
-        twc_message_queue_add_friend_message(chat->profile,
-                                             chat->friend_number,
-                                             message, message_type);
+        uint64_t message_id;
+        enum t_twc_rc rc =
+            twc_message_queue_add_friend_message(chat->profile,
+                                                 chat->friend_number,
+                                                 message, message_type,
+                                                 &message_id);
+        if (rc == TWC_RC_DROPPED)
+        {
+            weechat_printf(chat->buffer,
+                           "%s%s: message dropped, too many messages are "
+                           "queued (see /tox queues)",
+                           weechat_prefix("network"), weechat_plugin->name);
+            return;
+        }
+        else if (rc != TWC_RC_OK)
+        {
+            const char *reason;
+            switch (rc)
+            {
+                case TWC_RC_ERROR_FULL:
+                    reason = "too many messages are queued (see /tox queues)";
+                    break;
+                case TWC_RC_ERROR_TOO_LARGE:
+                    reason = "it is larger than the queue limits";
+                    break;
+                case TWC_RC_ERROR:
+                    reason = "it is empty";
+                    break;
+                case TWC_RC_ERROR_MALLOC:
+                    reason = "out of memory";
+                    break;
+                default:
+                    reason = "it could not be queued";
+                    break;
+            }
+
+            weechat_printf(chat->buffer,
+                           "%s%s: message not sent, %s",
+                           weechat_prefix("error"), weechat_plugin->name,
+                           reason);
+            return;
+        }
+
+        char message_tag[64], tags[64];
+        snprintf(message_tag, sizeof(message_tag), "%s%" PRIu64,
+                 TWC_CHAT_MESSAGE_TAG, message_id);
+        snprintf(tags, sizeof(tags), "%s,%s",
+                 twc_tag_unsent_message, message_tag);
+
         char *name = twc_get_self_name_nt(chat->profile->tox);
-        twc_chat_print_message(chat, "", name, message, message_type);
+        twc_chat_print_message(chat, tags, name, message, message_type);
         free(name);
+
+        // remember the line to mark it as sent later without searching for
+        // it, as a backlog can complete thousands of messages
+        void *lines = weechat_hdata_pointer(weechat_hdata_get("buffer"),
+                                            chat->buffer, "own_lines");
+        void *line = lines ? weechat_hdata_pointer(weechat_hdata_get("lines"),
+                                                   lines, "last_line")
+                           : NULL;
+        if (line)
+            weechat_hashtable_set(chat->unsent_lines, message_tag, line);
     }
     else if (chat->group_number >= 0)
     {
@@ -324,6 +414,99 @@ twc_chat_send_message(struct t_twc_chat *chat, const char *message,
     }
 }
 
+/**
+ * Mark the line of a queued message as sent, once the friend has received
+ * all of it. The line was remembered when the message was printed; it may be
+ * gone since (e.g. if the buffer was cleared), or was never printed if the
+ * message was restored from the journal.
+ */
+void
+twc_chat_mark_message_sent(struct t_twc_chat *chat, uint64_t message_id)
+{
+    char message_tag[64];
+    snprintf(message_tag, sizeof(message_tag), "%s%" PRIu64,
+             TWC_CHAT_MESSAGE_TAG, message_id);
+
+    void *line = weechat_hashtable_get(chat->unsent_lines, message_tag);
+    if (!line)
+        return;
+    weechat_hashtable_remove(chat->unsent_lines, message_tag);
+
+    struct t_hdata *hdata_buffer = weechat_hdata_get("buffer");
+    struct t_hdata *hdata_lines = weechat_hdata_get("lines");
+    struct t_hdata *hdata_line = weechat_hdata_get("line");
+    struct t_hdata *hdata_line_data = weechat_hdata_get("line_data");
+
+    void *lines = weechat_hdata_pointer(hdata_buffer, chat->buffer,
+                                        "own_lines");
+    void *first_line = lines ? weechat_hdata_pointer(hdata_lines, lines,
+                                                     "first_line")
+                             : NULL;
+    if (!first_line
+        || !weechat_hdata_check_pointer(hdata_line, first_line, line))
+        return;
+
+    void *line_data = weechat_hdata_pointer(hdata_line, line, "data");
+    if (!line_data)
+        return;
+
+    int tags_count = weechat_hdata_integer(hdata_line_data, line_data,
+                                           "tags_count");
+
+    // the line may have been freed and its memory reused for another one
+    bool found = false;
+    char name[32];
+    for (int i = 0; i < tags_count && !found; ++i)
+    {
+        snprintf(name, sizeof(name), "%d|tags_array", i);
+        const char *tag = weechat_hdata_string(hdata_line_data, line_data,
+                                               name);
+        found = tag && strcmp(tag, message_tag) == 0;
+    }
+    if (!found)
+        return;
+
+    // rebuild the tags with unsent replaced by sent
+    const char **tags = malloc(sizeof(char *) * (tags_count + 1));
+    if (!tags)
+        return;
+    for (int i = 0; i < tags_count; ++i)
+    {
+        snprintf(name, sizeof(name), "%d|tags_array", i);
+        tags[i] = weechat_hdata_string(hdata_line_data, line_data, name);
+        if (!tags[i])
+            tags[i] = "";
+        else if (strcmp(tags[i], twc_tag_unsent_message) == 0)
+            tags[i] = twc_tag_sent_message;
+    }
+    tags[tags_count] = NULL;
+    char *tags_string = weechat_string_build_with_split_string(tags, ",");
+
+    struct t_hashtable *update =
+        weechat_hashtable_new(4,
+                              WEECHAT_HASHTABLE_STRING,
+                              WEECHAT_HASHTABLE_STRING,
+                              NULL, NULL);
+    weechat_hashtable_set(update, "tags_array", tags_string);
+    weechat_hdata_update(hdata_line_data, line_data, update);
+    weechat_hashtable_free(update);
+    free(tags_string);
+    free(tags);
+}
+
+/**
+ * Forget the line of a queued message that will not be sent.
+ */
+void
+twc_chat_forget_message(struct t_twc_chat *chat, uint64_t message_id)
+{
+    char message_tag[64];
+    snprintf(message_tag, sizeof(message_tag), "%s%" PRIu64,
+             TWC_CHAT_MESSAGE_TAG, message_id);
+
+    weechat_hashtable_remove(chat->unsent_lines, message_tag);
+}
+
 /**
  * Callback for a buffer receiving user input.
  */
@@ -332,7 +515,11 @@ twc_chat_buffer_input_callback(void *data, struct t_gui_buffer *weechat_buffer,
                                const char *input_data)
 {
     struct t_twc_chat *chat = data;
+
+    twc_worker_lock(chat->profile);
     twc_chat_send_message(chat, input_data, TWC_MESSAGE_TYPE_MESSAGE);
+    twc_worker_unlock(chat->profile);
+    twc_profile_wake(chat->profile);
 
     return WEECHAT_RC_OK;
 }
@@ -347,7 +534,9 @@ twc_chat_buffer_close_callback(void *data, struct t_gui_buffer *weechat_buffer)
 
     if (chat->profile->tox && chat->group_number >= 0)
     {
+        twc_worker_lock(chat->profile);
         int rc = tox_del_groupchat(chat->profile->tox, chat->group_number);
+        twc_worker_unlock(chat->profile);
         if (rc != 0)
         {
             weechat_printf(chat->profile->buffer,
@@ -356,20 +545,40 @@ twc_chat_buffer_close_callback(void *data, struct t_gui_buffer *weechat_buffer)
         }
     }
 
-    twc_list_remove_with_data(chat->profile->chats, chat);
+    twc_list_remove(&chat->list_item);
     twc_chat_free(chat);
 
     return WEECHAT_RC_OK;
 }
 
 /**
- * Free a chat object.
+ * Free a chat object. Also removes it from the chat indexes.
  */
 void
 twc_chat_free(struct t_twc_chat *chat)
 {
+    weechat_hashtable_remove(twc_chat_buffers, chat->buffer);
+    if (chat->friend_number >= 0)
+        weechat_hashtable_remove(chat->profile->friend_chats,
+                                 &chat->friend_number);
+    if (chat->group_number >= 0)
+        weechat_hashtable_remove(chat->profile->group_chats,
+                                 &chat->group_number);
+
+    // drop a pending refresh
+    if (chat->refresh_queued)
+    {
+        struct t_twc_chat **link = &chat->profile->dirty_chats;
+        while (*link != chat)
+            link = &(*link)->next_dirty_chat;
+        *link = chat->next_dirty_chat;
+    }
+
     if (chat->nicks)
-        weechat_hashtable_free(chat->nicks);
+        twc_key_map_free(chat->nicks);
+    weechat_hashtable_free(chat->unsent_lines);
+    free(chat->short_name);
+    free(chat->title);
     free(chat);
 }
 
@@ -380,7 +589,7 @@ void
 twc_chat_free_list(struct t_twc_list *list)
 {
     struct t_twc_chat *chat;
-    while ((chat = twc_list_pop(list)))
+    while ((chat = twc_list_pop_data(list, struct t_twc_chat, list_item)))
     {
         weechat_buffer_set_pointer(chat->buffer, "close_callback", NULL);
         weechat_buffer_close(chat->buffer);
@@ -390,3 +599,13 @@ twc_chat_free_list(struct t_twc_list *list)
     free(list);
 }
 
+/**
+ * Free the buffer to chat index.
+ */
+void
+twc_chat_end()
+{
+    weechat_hashtable_free(twc_chat_buffers);
+    twc_chat_buffers = NULL;
+}
+
@@ -22,8 +22,11 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 
-struct t_twc_list;
+#include "twc-list.h"
+
+struct t_twc_key_map;
 
 extern const char *twc_tag_unsent_message;
 extern const char *twc_tag_sent_message;
@@ -44,9 +47,24 @@ struct t_twc_chat
     int32_t group_number;
 
     struct t_gui_nick_group *nicklist_group;
-    struct t_hashtable *nicks;
+    struct t_twc_key_map *nicks;
+
+    // last short_name and title given to the buffer
+    char *short_name;
+    char *title;
+
+    bool refresh_queued;
+    struct t_twc_chat *next_dirty_chat;
+
+    // lines of messages not sent yet, by message tag
+    struct t_hashtable *unsent_lines;
+
+    struct t_twc_list_item list_item;
 };
 
+void
+twc_chat_init();
+
 struct t_twc_chat *
 twc_chat_search_friend(struct t_twc_profile *profile,
                        int32_t friend_number, bool create_new);
@@ -69,6 +87,12 @@ void
 twc_chat_send_message(struct t_twc_chat *chat, const char *message,
                       enum TWC_MESSAGE_TYPE message_type);
 
+void
+twc_chat_mark_message_sent(struct t_twc_chat *chat, uint64_t message_id);
+
+void
+twc_chat_forget_message(struct t_twc_chat *chat, uint64_t message_id);
+
 void
 twc_chat_queue_refresh(struct t_twc_chat *chat);
 
@@ -78,5 +102,8 @@ twc_chat_free(struct t_twc_chat *chat);
 void
 twc_chat_free_list(struct t_twc_list *list);
 
+void
+twc_chat_end();
+
 #endif // TOX_WEECHAT_CHAT_H
 
@@ -28,10 +28,14 @@
 #include "twc-profile.h"
 #include "twc-chat.h"
 #include "twc-friend-request.h"
+#include "twc-gui.h"
+#include "twc-message-queue.h"
+#include "twc-roster.h"
 #include "twc-group-invite.h"
 #include "twc-bootstrap.h"
 #include "twc-config.h"
 #include "twc-utils.h"
+#include "twc-worker.h"
 
 #include "twc-commands.h"
 
@@ -142,46 +146,66 @@ enum TWC_FRIEND_MATCH
 enum TWC_FRIEND_MATCH
 twc_match_friend(struct t_twc_profile *profile, const char *search_string)
 {
-    uint32_t friend_count = tox_self_get_friend_list_size(profile->tox);
-    uint32_t *friend_numbers = malloc(sizeof(uint32_t) * friend_count);
-    tox_self_get_friend_list(profile->tox, friend_numbers);
-
-    int32_t match = TWC_FRIEND_MATCH_NOMATCH;
-
     char *endptr;
     uint32_t friend_number = (uint32_t)strtoul(search_string, &endptr, 10);
     if (endptr == search_string + strlen(search_string)
-        && tox_friend_exists(profile->tox, friend_number))
+        && twc_roster_get(profile, friend_number))
         return friend_number;
 
-    size_t search_size = strlen(search_string);
-    for (uint32_t i = 0; i < friend_count; ++i)
+    struct t_twc_friend *friend;
+    if (strlen(search_string) == TOX_PUBLIC_KEY_SIZE * 2)
     {
-        if (search_size == TOX_PUBLIC_KEY_SIZE * 2)
-        {
-            uint8_t tox_id[TOX_PUBLIC_KEY_SIZE];
-            char hex_id[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+        if (twc_hex2bin(search_string, TOX_PUBLIC_KEY_SIZE, public_key)
+            == TOX_PUBLIC_KEY_SIZE * 2
+            && (friend = twc_roster_search_key(profile, public_key)))
+            return friend->friend_number;
+    }
 
-            if (tox_friend_get_public_key(profile->tox, friend_numbers[i], tox_id, NULL))
-            {
-                twc_bin2hex(tox_id, TOX_PUBLIC_KEY_SIZE, hex_id);
+    bool ambiguous;
+    friend = twc_roster_search_name(profile, search_string, &ambiguous);
+    if (!friend)
+        return TWC_FRIEND_MATCH_NOMATCH;
+    if (ambiguous)
+        return TWC_FRIEND_MATCH_AMBIGUOUS;
 
-                if (weechat_strcasecmp(hex_id, search_string) == 0)
-                    return friend_numbers[i];
-            }
-        }
+    return friend->friend_number;
+}
 
-        char *name = twc_get_name_nt(profile->tox, friend_numbers[i]);
-        if (weechat_strcasecmp(name, search_string) == 0)
-        {
-            if (match == TWC_FRIEND_MATCH_NOMATCH)
-                match = friend_numbers[i];
-            else
-                return TWC_FRIEND_MATCH_AMBIGUOUS;
-        }
-    }
+/**
+ * Compare two friends by case-folded name, then number. For qsort.
+ */
+int
+twc_cmd_friend_compare_name(const void *a, const void *b)
+{
+    const struct t_twc_friend *friend_a = *(struct t_twc_friend * const *)a;
+    const struct t_twc_friend *friend_b = *(struct t_twc_friend * const *)b;
+
+    int cmp = strcmp(friend_a->folded_name ? friend_a->folded_name : "",
+                     friend_b->folded_name ? friend_b->folded_name : "");
+    if (cmp)
+        return cmp;
 
-    return match;
+    return (friend_a->friend_number > friend_b->friend_number)
+        - (friend_a->friend_number < friend_b->friend_number);
+}
+
+/**
+ * Compare two friends by connection status (online first), then name. For
+ * qsort.
+ */
+int
+twc_cmd_friend_compare_status(const void *a, const void *b)
+{
+    const struct t_twc_friend *friend_a = *(struct t_twc_friend * const *)a;
+    const struct t_twc_friend *friend_b = *(struct t_twc_friend * const *)b;
+
+    bool online_a = friend_a->connection != TOX_CONNECTION_NONE;
+    bool online_b = friend_b->connection != TOX_CONNECTION_NONE;
+    if (online_a != online_b)
+        return online_b - online_a;
+
+    return twc_cmd_friend_compare_name(a, b);
 }
 
 /**
@@ -226,41 +250,161 @@ twc_cmd_friend(void *data, struct t_gui_buffer *buffer,
     TWC_CHECK_PROFILE(profile);
     TWC_CHECK_PROFILE_LOADED(profile);
 
-    // /friend or /friend list
-    if (argc == 1 || (argc == 2 && weechat_strcasecmp(argv[1], "list") == 0))
+    // /friend list [-online|-offline] [-sort name|status|number] [-page N]
+    //              [<pattern>]
+    if (argc == 1 || weechat_strcasecmp(argv[1], "list") == 0)
     {
-        size_t friend_count = tox_self_get_friend_list_size(profile->tox);
-        uint32_t friend_numbers[friend_count];
-        tox_self_get_friend_list(profile->tox, friend_numbers);
+        int connection_filter = 0;
+        int (*compare)(const void *, const void *) = NULL;
+        long page = 1;
+        char *mask = NULL;
+
+        for (int i = 2; i < argc; ++i)
+        {
+            if (weechat_strcasecmp(argv[i], "-online") == 0)
+                connection_filter = 1;
+            else if (weechat_strcasecmp(argv[i], "-offline") == 0)
+                connection_filter = -1;
+            else if (weechat_strcasecmp(argv[i], "-sort") == 0)
+            {
+                if (++i == argc)
+                {
+                    free(mask);
+                    return WEECHAT_RC_ERROR;
+                }
+                if (weechat_strcasecmp(argv[i], "name") == 0)
+                    compare = twc_cmd_friend_compare_name;
+                else if (weechat_strcasecmp(argv[i], "status") == 0)
+                    compare = twc_cmd_friend_compare_status;
+                else if (weechat_strcasecmp(argv[i], "number") == 0)
+                    compare = NULL;
+                else
+                {
+                    free(mask);
+                    return WEECHAT_RC_ERROR;
+                }
+            }
+            else if (weechat_strcasecmp(argv[i], "-page") == 0)
+            {
+                if (++i == argc)
+                {
+                    free(mask);
+                    return WEECHAT_RC_ERROR;
+                }
+                char *endptr;
+                page = strtol(argv[i], &endptr, 10);
+                if (*endptr || page < 1)
+                {
+                    free(mask);
+                    return WEECHAT_RC_ERROR;
+                }
+            }
+            else if (!mask)
+            {
+                // match anywhere unless the pattern has its own wildcards
+                size_t length = strlen(argv[i]) + 3;
+                mask = malloc(length);
+                if (!mask)
+                    return WEECHAT_RC_OK;
+                snprintf(mask, length, strchr(argv[i], '*') ? "%s" : "*%s*",
+                         argv[i]);
+            }
+            else
+            {
+                free(mask);
+                return WEECHAT_RC_ERROR;
+            }
+        }
 
-        if (friend_count == 0)
+        struct t_twc_roster *roster = profile->roster;
+        if (roster->count == 0)
         {
             weechat_printf(profile->buffer,
                            "%sYou have no friends :(",
                            weechat_prefix("network"));
+            free(mask);
+            return WEECHAT_RC_OK;
+        }
+
+        // snapshot the friends to show, in friend number order
+        struct t_twc_friend **friends = malloc(roster->count
+                                               * sizeof(struct t_twc_friend *));
+        if (!friends)
+        {
+            free(mask);
             return WEECHAT_RC_OK;
         }
 
+        size_t count = 0;
+        for (size_t i = 0; i < roster->size; ++i)
+        {
+            struct t_twc_friend *friend = roster->friends[i];
+            if (!friend)
+                continue;
+
+            bool online = friend->connection != TOX_CONNECTION_NONE;
+            if ((connection_filter > 0 && !online)
+                || (connection_filter < 0 && online))
+                continue;
+
+            if (mask
+                && !weechat_string_match(twc_roster_name(profile, i), mask, 0)
+                && !weechat_string_match(friend->id, mask, 0))
+                continue;
+
+            friends[count++] = friend;
+        }
+        free(mask);
+
+        size_t page_size =
+            weechat_config_integer(twc_config_friend_list_page_size);
+        size_t page_count = (count + page_size - 1) / page_size;
+        if (count == 0)
+        {
+            weechat_printf(profile->buffer,
+                           "%sNo friends found.",
+                           weechat_prefix("network"));
+            free(friends);
+            return WEECHAT_RC_OK;
+        }
+        if ((size_t)page > page_count)
+        {
+            weechat_printf(profile->buffer,
+                           "%sThere are only %zu pages of friends.",
+                           weechat_prefix("error"), page_count);
+            free(friends);
+            return WEECHAT_RC_OK;
+        }
+
+        size_t first = (page - 1) * page_size;
+        size_t last = first + page_size < count ? first + page_size : count;
+
+        // only the rows on this page need to be in order
+        if (compare)
+            twc_partial_sort((void **)friends, count, first, last, compare);
+
+        weechat_printf(profile->buffer,
+                       "%sFriends %zu-%zu of %zu (page %ld/%zu):",
+                       weechat_prefix("network"),
+                       first + 1, last, count, page, page_count);
         weechat_printf(profile->buffer,
                        "%s[#] Name [Tox ID (short)]",
                        weechat_prefix("network"));
 
-        for (size_t i = 0; i < friend_count; ++i)
+        for (size_t i = first; i < last; ++i)
         {
-            uint32_t friend_number = friend_numbers[i];
-            char *name = twc_get_name_nt(profile->tox, friend_number);
-            char *hex_address = twc_get_friend_id_short(profile->tox,
-                                                        friend_number);
-
+            struct t_twc_friend *friend = friends[i];
             weechat_printf(profile->buffer,
-                           "%s[%d] %s [%s]",
+                           "%s[%u] %s [%s]%s",
                            weechat_prefix("network"),
-                           friend_number, name, hex_address);
-
-            free(name);
-            free(hex_address);
+                           friend->friend_number,
+                           twc_roster_name(profile, friend->friend_number),
+                           friend->short_id,
+                           friend->connection != TOX_CONNECTION_NONE
+                               ? " (online)" : "");
         }
 
+        free(friends);
         return WEECHAT_RC_OK;
     }
 
@@ -296,19 +440,30 @@ twc_cmd_friend(void *data, struct t_gui_buffer *buffer,
         }
 
         uint8_t address[TOX_ADDRESS_SIZE];
-        twc_hex2bin(hex_id, TOX_ADDRESS_SIZE, address);
+        size_t valid_length = twc_hex2bin(hex_id, TOX_ADDRESS_SIZE, address);
+        if (valid_length != TOX_ADDRESS_SIZE * 2)
+        {
+            weechat_printf(profile->buffer,
+                           "%sTox ID contains invalid character '%c' at "
+                           "position %zu. Please try again.",
+                           weechat_prefix("error"),
+                           hex_id[valid_length], valid_length + 1);
+
+            return WEECHAT_RC_OK;
+        }
 
         if (force)
         {
             bool fail = false;
-            char *hex_key = strndup(hex_id, TOX_PUBLIC_KEY_SIZE * 2);
-            int32_t friend_number = twc_match_friend(profile, hex_key);
-            free(hex_key);
-
-            if (friend_number == TWC_FRIEND_MATCH_AMBIGUOUS)
-                fail = true;
-            else if (friend_number != TWC_FRIEND_MATCH_NOMATCH)
+            struct t_twc_friend *friend = twc_roster_search_key(profile,
+                                                                address);
+            if (friend)
+            {
+                uint32_t friend_number = friend->friend_number;
                 fail = !tox_friend_delete(profile->tox, friend_number, NULL);
+                if (!fail)
+                    twc_roster_remove(profile, friend_number);
+            }
 
             if (fail)
             {
@@ -321,14 +476,15 @@ twc_cmd_friend(void *data, struct t_gui_buffer *buffer,
         }
 
         TOX_ERR_FRIEND_ADD err;
-        (void)tox_friend_add(profile->tox,
-                                         (uint8_t *)address,
-                                         (uint8_t *)message,
-                                         strlen(message), &err);
+        uint32_t friend_number = tox_friend_add(profile->tox,
+                                                (uint8_t *)address,
+                                                (uint8_t *)message,
+                                                strlen(message), &err);
 
         switch (err)
         {
             case TOX_ERR_FRIEND_ADD_OK:
+                twc_roster_add(profile, friend_number);
                 weechat_printf(profile->buffer,
                                "%sFriend request sent!",
                                weechat_prefix("network"));
@@ -379,12 +535,13 @@ twc_cmd_friend(void *data, struct t_gui_buffer *buffer,
         int32_t friend_number = twc_match_friend(profile, argv[2]);
         TWC_CHECK_FRIEND_NUMBER(profile, friend_number, argv[2]);
 
-        char *name = twc_get_name_nt(profile->tox, friend_number);
-        if (tox_friend_delete(profile->tox, friend_number, NULL) == 0)
+        if (tox_friend_delete(profile->tox, friend_number, NULL))
         {
             weechat_printf(profile->buffer,
                            "%sRemoved %s from friend list.",
-                           weechat_prefix("network"), name);
+                           weechat_prefix("network"),
+                           twc_roster_name(profile, friend_number));
+            twc_roster_remove(profile, friend_number);
         }
         else
         {
@@ -393,8 +550,6 @@ twc_cmd_friend(void *data, struct t_gui_buffer *buffer,
                            weechat_prefix("error"));
         }
 
-        free(name);
-
         return WEECHAT_RC_OK;
     }
 
@@ -410,19 +565,20 @@ twc_cmd_friend(void *data, struct t_gui_buffer *buffer,
         {
             size_t index;
             size_t count = 0;
-            struct t_twc_list_item *item;
-            twc_list_foreach(profile->friend_requests, index, item)
+            struct t_twc_friend_request *next_request;
+            twc_list_foreach_safe(profile->friend_requests, index,
+                                  request, next_request, list_item)
             {
                 if (accept)
                 {
-                    if (twc_friend_request_accept(item->friend_request))
+                    if (twc_friend_request_accept(request))
                     {
                         ++count;
                     }
                     else
                     {
                         char hex_address[TOX_PUBLIC_KEY_SIZE * 2 + 1];
-                        twc_bin2hex(item->friend_request->tox_id,
+                        twc_bin2hex(request->tox_id,
                                     TOX_PUBLIC_KEY_SIZE,
                                     hex_address);
                         weechat_printf(profile->buffer,
@@ -432,9 +588,11 @@ twc_cmd_friend(void *data, struct t_gui_buffer *buffer,
                 }
                 else
                 {
-                    twc_friend_request_remove(item->friend_request);
+                    twc_friend_request_remove(request);
                     ++count;
                 }
+
+                twc_friend_request_free(request);
             }
 
             weechat_printf(profile->buffer,
@@ -499,12 +657,12 @@ twc_cmd_friend(void *data, struct t_gui_buffer *buffer,
                        weechat_prefix("network"));
 
         size_t index;
-        struct t_twc_list_item *item;
-        twc_list_foreach(profile->friend_requests, index, item)
+        struct t_twc_friend_request *request;
+        twc_list_foreach(profile->friend_requests, index, request, list_item)
         {
             size_t short_id_length = weechat_config_integer(twc_config_short_id_size);
             char hex_address[short_id_length + 1];
-            twc_bin2hex(item->friend_request->tox_id,
+            twc_bin2hex(request->tox_id,
                         short_id_length / 2,
                         hex_address);
 
@@ -513,7 +671,7 @@ twc_cmd_friend(void *data, struct t_gui_buffer *buffer,
                            "[%d] Message: %s",
                            weechat_prefix("network"),
                            index, hex_address,
-                           index, item->friend_request->message);
+                           index, request->message);
         }
 
         return WEECHAT_RC_OK;
@@ -594,16 +752,14 @@ twc_cmd_group(void *data, struct t_gui_buffer *buffer,
                        weechat_prefix("network"));
 
         size_t index;
-        struct t_twc_list_item *item;
-        twc_list_foreach(profile->group_chat_invites, index, item)
+        struct t_twc_group_chat_invite *invite;
+        twc_list_foreach(profile->group_chat_invites, index, invite, list_item)
         {
-            char *friend_name =
-                twc_get_name_nt(profile->tox, item->group_chat_invite->friend_number);
             weechat_printf(profile->buffer,
                            "%s[%d] From: %s",
                            weechat_prefix("network"),
-                           index, friend_name);
-            free(friend_name);
+                           index,
+                           twc_roster_name(profile, invite->friend_number));
         }
 
         return WEECHAT_RC_OK;
@@ -635,10 +791,9 @@ twc_cmd_invite(void *data, struct t_gui_buffer *buffer,
 
     if (rc == 0)
     {
-        char *friend_name = twc_get_name_nt(chat->profile->tox, friend_number);
         weechat_printf(chat->buffer, "%sInvited %s to the group chat.",
-                       weechat_prefix("network"), friend_name);
-       free(friend_name);
+                       weechat_prefix("network"),
+                       twc_roster_name(chat->profile, friend_number));
     }
     else
     {
@@ -757,7 +912,11 @@ twc_cmd_name(void *data, struct t_gui_buffer *buffer,
     const char *name = argv_eol[1];
 
     TOX_ERR_SET_INFO err;
+    twc_worker_lock(profile);
     tox_self_set_name(profile->tox, (uint8_t *)name, strlen(name), &err);
+    if (err == TOX_ERR_SET_INFO_OK)
+        twc_profile_refresh_self(profile);
+    twc_worker_unlock(profile);
     if (err != TOX_ERR_SET_INFO_OK)
     {
         char *err_msg;
@@ -780,18 +939,16 @@ twc_cmd_name(void *data, struct t_gui_buffer *buffer,
         return WEECHAT_RC_OK;
     }
 
-    weechat_bar_item_update("input_prompt");
-
     weechat_printf(profile->buffer,
                    "%sYou are now known as %s",
                    weechat_prefix("network"),
                    name);
 
     size_t index;
-    struct t_twc_list_item *item;
-    twc_list_foreach(profile->chats, index, item)
+    struct t_twc_chat *chat;
+    twc_list_foreach(profile->chats, index, chat, list_item)
     {
-        weechat_printf(item->chat->buffer,
+        weechat_printf(chat->buffer,
                        "%sYou are now known as %s",
                        weechat_prefix("network"),
                        name);
@@ -876,7 +1033,7 @@ twc_cmd_part(void *data, struct t_gui_buffer *buffer,
     weechat_buffer_set_pointer(chat->buffer, "input_callback", NULL);
     weechat_buffer_set_pointer(chat->buffer, "close_callback", NULL);
 
-    twc_list_remove_with_data(chat->profile->chats, chat);
+    twc_list_remove(&chat->list_item);
     twc_chat_free(chat);
 
     return WEECHAT_RC_OK;
@@ -889,23 +1046,25 @@ int
 twc_cmd_save(void *data, struct t_gui_buffer *buffer, const char *command)
 {
     size_t index;
-    struct t_twc_list_item *item;
-    twc_list_foreach(twc_profiles, index, item)
+    struct t_twc_profile *profile;
+    twc_list_foreach(twc_profiles, index, profile, list_item)
     {
-        if (!(item->profile->tox)) continue;
+        if (!(profile->tox)) continue;
 
-        int rc = twc_profile_save_data_file(item->profile);
+        twc_worker_lock(profile);
+        int rc = twc_profile_save_data_file(profile);
+        twc_worker_unlock(profile);
         if (rc == -1)
         {
             weechat_printf(NULL,
                            "%s%s: failed to save data for profile %s",
                            weechat_prefix("error"), weechat_plugin->name,
-                           item->profile->name);
+                           profile->name);
         }
     }
 
     weechat_printf(NULL,
-                   "%s: profile data saved",
+                   "%s: saving profile data",
                    weechat_plugin->name);
 
     return WEECHAT_RC_OK;
@@ -935,8 +1094,13 @@ twc_cmd_status(void *data, struct t_gui_buffer *buffer,
     else
         return WEECHAT_RC_ERROR;
 
-    tox_self_set_status(profile->tox, status);
-    weechat_bar_item_update("away");
+    if (profile->self_status != status)
+    {
+        twc_worker_lock(profile);
+        tox_self_set_status(profile->tox, status);
+        twc_profile_refresh_self(profile);
+        twc_worker_unlock(profile);
+    }
 
     return WEECHAT_RC_OK;
 }
@@ -1035,13 +1199,154 @@ twc_cmd_tox(void *data, struct t_gui_buffer *buffer,
                        "%sAll Tox profiles:",
                        weechat_prefix("network"));
         size_t index;
-        struct t_twc_list_item *item;
-        twc_list_foreach(twc_profiles, index, item)
+        struct t_twc_profile *profile;
+        twc_list_foreach(twc_profiles, index, profile, list_item)
         {
             weechat_printf(NULL,
                            "%s%s",
                            weechat_prefix("network"),
-                           item->profile->name);
+                           profile->name);
+        }
+
+        return WEECHAT_RC_OK;
+    }
+
+    // /tox stats
+    else if (argc == 2 && weechat_strcasecmp(argv[1], "stats") == 0)
+    {
+        weechat_printf(NULL,
+                       "%sTox iteration statistics:",
+                       weechat_prefix("network"));
+        size_t index;
+        struct t_twc_profile *profile;
+        twc_list_foreach(twc_profiles, index, profile, list_item)
+        {
+            if (!profile->tox)
+                continue;
+
+            // a worker thread updates its profile's statistics
+            twc_worker_lock(profile);
+            struct t_twc_scheduler_entry schedule = profile->schedule;
+            twc_worker_unlock(profile);
+
+            int64_t lateness_average = schedule.iterations
+                ? schedule.lateness_total / (int64_t)schedule.iterations
+                : 0;
+            weechat_printf(NULL,
+                           "%s%s: %llu iterations, now every %ld ms%s, late by "
+                           "%.1f ms on average, %.1f ms at most",
+                           weechat_prefix("network"), profile->name,
+                           (unsigned long long)schedule.iterations,
+                           schedule.interval,
+                           profile->worker ? " (threaded)" : "",
+                           lateness_average / 1000.0,
+                           schedule.lateness_max / 1000.0);
+            if (schedule.wakeups_per_minute > 0)
+                weechat_printf(NULL, "%s  %.0f wakeups per minute",
+                               weechat_prefix("network"),
+                               schedule.wakeups_per_minute);
+
+            size_t count = profile->connection_history_count;
+            size_t first = count > TWC_PROFILE_CONNECTION_HISTORY
+                ? count - TWC_PROFILE_CONNECTION_HISTORY : 0;
+            for (size_t i = first; i < count; ++i)
+            {
+                struct t_twc_connection_transition *transition =
+                    &profile->connection_history[i % TWC_PROFILE_CONNECTION_HISTORY];
+
+                char time_string[64];
+                strftime(time_string, sizeof(time_string), "%Y-%m-%d %H:%M:%S",
+                         localtime(&transition->time));
+
+                const char *state;
+                switch (transition->connection)
+                {
+                    case TOX_CONNECTION_TCP:
+                        state = "connected over TCP"; break;
+                    case TOX_CONNECTION_UDP:
+                        state = "connected over UDP"; break;
+                    default:
+                        state = "disconnected"; break;
+                }
+
+                weechat_printf(NULL, "%s  %s: %s",
+                               weechat_prefix("network"), time_string, state);
+            }
+        }
+
+        return WEECHAT_RC_OK;
+    }
+
+    // /tox queues
+    else if (argc == 2 && weechat_strcasecmp(argv[1], "queues") == 0)
+    {
+        weechat_printf(NULL,
+                       "%sQueued messages:",
+                       weechat_prefix("network"));
+        time_t now = time(NULL);
+        int64_t now_us = twc_scheduler_now();
+        size_t index;
+        struct t_twc_profile *profile;
+        twc_list_foreach(twc_profiles, index, profile, list_item)
+        {
+            size_t memory = 0;
+            for (size_t i = 0; i < profile->message_queues_size; ++i)
+            {
+                if (profile->message_queues[i])
+                    memory += twc_message_queue_memory(profile->message_queues[i]);
+            }
+            weechat_printf(NULL,
+                           "%s%s: %zu messages, %zu bytes queued, %zu bytes "
+                           "allocated",
+                           weechat_prefix("network"), profile->name,
+                           profile->queued_message_count,
+                           profile->queued_message_bytes, memory);
+
+            for (size_t i = 0; i < profile->message_queues_size; ++i)
+            {
+                struct t_twc_message_queue *message_queue
+                    = profile->message_queues[i];
+                if (!message_queue
+                    || (message_queue->messages_count == 0
+                        && message_queue->dropped_count == 0))
+                    continue;
+
+                size_t unsent = message_queue->first_seq
+                                + message_queue->messages_count
+                                - message_queue->next_unsent;
+
+                char oldest[64] = "";
+                struct t_twc_queued_message *oldest_message
+                    = twc_message_queue_at(message_queue,
+                                           message_queue->first_seq);
+                if (oldest_message)
+                    snprintf(oldest, sizeof(oldest), ", oldest %lld s old",
+                             (long long)(now - oldest_message->time));
+
+                char dropped[64] = "";
+                if (message_queue->dropped_count > 0)
+                    snprintf(dropped, sizeof(dropped), ", %zu dropped",
+                             message_queue->dropped_count);
+
+                char retry[64] = "";
+                if (twc_timer_wheel_is_scheduled(&message_queue->retry))
+                {
+                    int64_t wait = message_queue->retry.due - now_us;
+                    snprintf(retry, sizeof(retry), ", retry %u in %.1f s",
+                             message_queue->retry_attempts,
+                             wait > 0 ? wait / 1000000.0 : 0.0);
+                }
+
+                weechat_printf(NULL,
+                               "%s  %s: %zu pending (%zu unsent), %zu bytes, "
+                               "%zu allocated%s%s%s",
+                               weechat_prefix("network"),
+                               twc_roster_name(profile, i),
+                               message_queue->messages_count, unsent,
+                               twc_message_queue_bytes(message_queue),
+                               twc_message_queue_memory(message_queue),
+                               oldest, dropped, retry);
+            }
         }
 
         return WEECHAT_RC_OK;
@@ -1146,6 +1451,33 @@ twc_cmd_tox(void *data, struct t_gui_buffer *buffer,
     return WEECHAT_RC_ERROR;
 }
 
+/**
+ * Run the command callback given as data with the Tox instance of the
+ * buffer's profile locked against its worker thread, if it has one. User
+ * input also ends any idle backoff.
+ */
+int
+twc_cmd_locked(void *data, struct t_gui_buffer *buffer,
+               int argc, char **argv, char **argv_eol)
+{
+    int (*callback)(void *data, struct t_gui_buffer *buffer,
+                    int argc, char **argv, char **argv_eol) = data;
+
+    struct t_twc_profile *profile = twc_profile_search_buffer(buffer);
+    if (profile)
+        twc_worker_lock(profile);
+
+    int rc = callback(NULL, buffer, argc, argv, argv_eol);
+
+    if (profile)
+    {
+        twc_worker_unlock(profile);
+        twc_profile_wake(profile);
+    }
+
+    return rc;
+}
+
 /**
  * Register Tox-WeeChat commands.
  */
@@ -1158,28 +1490,34 @@ twc_commands_init()
                          "address: internet address of node to bootstrap with\n"
                          "   port: port of the node\n"
                          " Tox ID: Tox ID of the node",
-                         "connect", twc_cmd_bootstrap, NULL);
+                         "connect", twc_cmd_locked, twc_cmd_bootstrap);
 
     weechat_hook_command("friend",
                          "manage friends",
-                         "list"
+                         "list [-online|-offline] [-sort name|status|number]"
+                         " [-page <n>] [<pattern>]"
                          " || add [-force] <address> [<message>]"
                          " || remove <number>|<name>|<Tox ID>"
                          " || requests"
                          " || accept <number>|<Tox ID>|all"
                          " || decline <number>|<Tox ID>|all",
-                         "    list: list all friends\n"
+                         "    list: list friends, optionally only those online "
+                         "or offline, sorted by name, status or number "
+                         "(default), or with a name or Tox ID matching "
+                         "pattern (wildcard \"*\" is allowed); long lists "
+                         "are split in pages of tox.look.friend_list_page_size "
+                         "friends\n"
                          "     add: add a friend by their public Tox address\n"
                          "requests: list friend requests\n"
                          "  accept: accept friend requests\n"
                          " decline: decline friend requests\n",
-                         "list"
+                         "list -online|-offline|-sort|-page"
                          " || add"
                          " || remove %(tox_friend_name)|%(tox_friend_tox_id)"
                          " || requests"
                          " || accept"
                          " || decline",
-                         twc_cmd_friend, NULL);
+                         twc_cmd_locked, twc_cmd_friend);
 
     weechat_hook_command("group",
                          "manage group chats",
@@ -1194,20 +1532,20 @@ twc_commands_init()
                          "create"
                          " || invites"
                          " || join",
-                         twc_cmd_group, NULL);
+                         twc_cmd_locked, twc_cmd_group);
 
     weechat_hook_command("invite",
                          "invite someone to a group chat",
                          "<number>|<name>|<Tox ID>",
                          "number, name, Tox ID: friend to message\n",
                          "%(tox_friend_name)|%(tox_friend_tox_id)",
-                         twc_cmd_invite, NULL);
+                         twc_cmd_locked, twc_cmd_invite);
 
     weechat_hook_command("me",
                          "send an action to the current chat",
                          "<message>",
                          "message: message to send",
-                         NULL, twc_cmd_me, NULL);
+                         NULL, twc_cmd_locked, twc_cmd_me);
 
     weechat_hook_command("msg",
                          "send a message to a Tox friend",
@@ -1215,18 +1553,18 @@ twc_commands_init()
                          "number, name, Tox ID: friend to message\n"
                          "message: message to send",
                          "%(tox_friend_name)|%(tox_friend_tox_id)",
-                         twc_cmd_msg, NULL);
+                         twc_cmd_locked, twc_cmd_msg);
 
     weechat_hook_command("myid",
                          "get your Tox ID to give to friends",
                          "", "",
-                         NULL, twc_cmd_myid, NULL);
+                         NULL, twc_cmd_locked, twc_cmd_myid);
 
     weechat_hook_command("name",
                          "change your Tox name",
                          "<name>",
                          "name: your new name",
-                         NULL, twc_cmd_name, NULL);
+                         NULL, twc_cmd_locked, twc_cmd_name);
 
     weechat_hook_command("nospam",
                          "change nospam value",
@@ -1235,12 +1573,12 @@ twc_commands_init()
                          "new value is used\n\n"
                          "Warning: changing your nospam value will alter your "
                          "Tox ID!",
-                         NULL, twc_cmd_nospam, NULL);
+                         NULL, twc_cmd_locked, twc_cmd_nospam);
 
     weechat_hook_command("part",
                          "leave a group chat",
                          "", "",
-                         NULL, twc_cmd_part, NULL);
+                         NULL, twc_cmd_locked, twc_cmd_part);
 
     weechat_hook_command_run("/save", twc_cmd_save, NULL);
 
@@ -1248,29 +1586,38 @@ twc_commands_init()
                          "change your Tox status",
                          "online|busy|away",
                          "",
-                         NULL, twc_cmd_status, NULL);
+                         NULL, twc_cmd_locked, twc_cmd_status);
 
     weechat_hook_command("statusmsg",
                          "change your Tox status message",
                          "[<message>]",
                          "message: your new status message",
-                         NULL, twc_cmd_statusmsg, NULL);
+                         NULL, twc_cmd_locked, twc_cmd_statusmsg);
 
     weechat_hook_command("topic",
                          "set a group chat topic",
                          "<topic>",
                          "topic: new group chat topic",
-                         NULL, twc_cmd_topic, NULL);
+                         NULL, twc_cmd_locked, twc_cmd_topic);
 
     weechat_hook_command("tox",
                          "manage Tox profiles",
                          "list"
+                         " || stats"
+                         " || queues"
                          " || create <name>"
                          " || delete <name> -yes|-keepdata"
                          " || load [<name>...]"
                          " || unload [<name>...]"
                          " || reload [<name>...]",
                          "  list: list all Tox profile\n"
+                         " stats: show how often and how punctually loaded "
+                         "profiles are iterated, and their recent connection "
+                         "changes\n"
+                         "queues: show the messages queued for each friend, "
+                         "the memory they use, how long the oldest has "
+                         "waited, how many were dropped for going over the "
+                         "queue limits and when sending will be retried\n"
                          "create: create a new Tox profile\n"
                          "delete: delete a Tox profile; requires either -yes "
                          "to confirm deletion or -keepdata to delete the "
@@ -1279,6 +1626,8 @@ twc_commands_init()
                          "unload: unload one or more Tox profiles\n"
                          "reload: reload one or more Tox profiles\n",
                          "list"
+                         " || stats"
+                         " || queues"
                          " || create"
                          " || delete %(tox_profiles) -yes|-keepdata"
                          " || load %(tox_unloaded_profiles)|%*"
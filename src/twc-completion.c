@@ -25,7 +25,8 @@
 #include "twc.h"
 #include "twc-list.h"
 #include "twc-profile.h"
-#include "twc-utils.h"
+#include "twc-roster.h"
+#include "twc-trie.h"
 
 #include "twc-completion.h"
 
@@ -42,6 +43,64 @@ enum
     TWC_COMPLETE_FRIEND_ID = 1 << 1,
 };
 
+/**
+ * Rebuild a profile's friend name and Tox ID completion tries if its roster
+ * has changed since they were built. Names containing spaces are quoted.
+ */
+void
+twc_completion_update_friends(struct t_twc_profile *profile)
+{
+    struct t_twc_roster *roster = profile->roster;
+    if (profile->completion_names
+        && profile->completion_generation == roster->generation)
+        return;
+
+    twc_completion_free_profile(profile);
+    profile->completion_names = twc_trie_new();
+    profile->completion_ids = twc_trie_new();
+    if (!profile->completion_names || !profile->completion_ids)
+    {
+        twc_completion_free_profile(profile);
+        return;
+    }
+
+    for (size_t i = 0; i < roster->size; ++i)
+    {
+        struct t_twc_friend *friend = roster->friends[i];
+        if (!friend)
+            continue;
+
+        twc_trie_insert(profile->completion_ids, friend->id);
+
+        const char *name = twc_roster_name(profile, friend->friend_number);
+        if (strchr(name, ' '))
+        {
+            size_t length = strlen(name) + 3;
+            char quoted_name[length];
+            snprintf(quoted_name, length, "\"%s\"", name);
+
+            twc_trie_insert(profile->completion_names, quoted_name);
+        }
+        else
+        {
+            twc_trie_insert(profile->completion_names, name);
+        }
+    }
+
+    profile->completion_generation = roster->generation;
+}
+
+/**
+ * Add a string to a completion list. Trie callback.
+ */
+void
+twc_completion_add_callback(void *data, const char *string)
+{
+    struct t_gui_completion *completion = data;
+    weechat_hook_completion_list_add(completion, string, 0,
+                                     WEECHAT_LIST_POS_END);
+}
+
 /**
  * Complete a friends name and/or Tox ID.
  */
@@ -54,52 +113,25 @@ twc_completion_friend(void *data,
     int flags = (int)(intptr_t)data;
     struct t_twc_profile *profile = twc_profile_search_buffer(buffer);
 
-    if (!profile)
+    if (!profile || !profile->tox)
         return WEECHAT_RC_OK;
 
-    uint32_t friend_count = tox_self_get_friend_list_size(profile->tox);
-    uint32_t *friend_numbers = malloc(sizeof(uint32_t) * friend_count);
-    tox_self_get_friend_list(profile->tox, friend_numbers);
-
-    for (uint32_t i = 0; i < friend_count; ++i)
-    {
-        if (flags & TWC_COMPLETE_FRIEND_ID)
-        {
-            uint8_t tox_id[TOX_PUBLIC_KEY_SIZE];
-            char hex_id[TOX_PUBLIC_KEY_SIZE * 2 + 1];
-
-            TOX_ERR_FRIEND_GET_PUBLIC_KEY err;
-            tox_friend_get_public_key(profile->tox, friend_numbers[i], tox_id, &err);
-            if (err == TOX_ERR_FRIEND_GET_PUBLIC_KEY_OK)
-            {
-                twc_bin2hex(tox_id, TOX_PUBLIC_KEY_SIZE, hex_id);
-
-                weechat_hook_completion_list_add(completion, hex_id, 0,
-                                                 WEECHAT_LIST_POS_SORT);
-            }
-        }
-
-        if (flags & TWC_COMPLETE_FRIEND_NAME)
-        {
-            char *name = twc_get_name_nt(profile->tox, friend_numbers[i]);
-
-            // add quotes if needed
-            if (strchr(name, ' '))
-            {
-                size_t length = strlen(name) + 3;
-                char *quoted_name = malloc(length);
-                snprintf(quoted_name, length, "\"%s\"", name);
+    twc_completion_update_friends(profile);
+    if (!profile->completion_names)
+        return WEECHAT_RC_OK;
 
-                free(name);
-                name = quoted_name;
-            }
+    // candidates come out of the tries sorted; only emit the ones that can
+    // match what has been typed so far
+    const char *base_word = weechat_hook_completion_get_string(completion,
+                                                               "base_word");
 
-            weechat_hook_completion_list_add(completion, name, 0,
-                                             WEECHAT_LIST_POS_SORT);
+    if (flags & TWC_COMPLETE_FRIEND_ID)
+        twc_trie_search_prefix(profile->completion_ids, base_word,
+                               twc_completion_add_callback, completion);
 
-            free(name);
-        }
-    }
+    if (flags & TWC_COMPLETE_FRIEND_NAME)
+        twc_trie_search_prefix(profile->completion_names, base_word,
+                               twc_completion_add_callback, completion);
 
     return WEECHAT_RC_OK;
 }
@@ -116,15 +148,15 @@ twc_completion_profile(void *data,
     int flag = (int)(intptr_t)data;
 
     size_t index;
-    struct t_twc_list_item *item;
-    twc_list_foreach(twc_profiles, index, item)
+    struct t_twc_profile *profile;
+    twc_list_foreach(twc_profiles, index, profile, list_item)
     {
         if (flag == TWC_ALL_PROFILES
-            || (flag == TWC_LOADED_PROFILES && item->profile->tox != NULL)
-            || (flag == TWC_UNLOADED_PROFILES && item->profile->tox == NULL))
+            || (flag == TWC_LOADED_PROFILES && profile->tox != NULL)
+            || (flag == TWC_UNLOADED_PROFILES && profile->tox == NULL))
         {
             weechat_hook_completion_list_add(completion,
-                                             item->profile->name,
+                                             profile->name,
                                              0, WEECHAT_LIST_POS_SORT);
         }
     }
@@ -152,3 +184,17 @@ twc_completion_init()
                             (void *)(intptr_t)TWC_COMPLETE_FRIEND_NAME);
 }
 
+/**
+ * Free the completion caches of a profile.
+ */
+void
+twc_completion_free_profile(struct t_twc_profile *profile)
+{
+    if (profile->completion_names)
+        twc_trie_free(profile->completion_names);
+    if (profile->completion_ids)
+        twc_trie_free(profile->completion_ids);
+
+    profile->completion_names = profile->completion_ids = NULL;
+}
+
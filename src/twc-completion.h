@@ -20,8 +20,13 @@
 #ifndef TOX_WEECHAT_COMPLETION_H
 #define TOX_WEECHAT_COMPLETION_H
 
+struct t_twc_profile;
+
 void
 twc_completion_init();
 
+void
+twc_completion_free_profile(struct t_twc_profile *profile);
+
 #endif // TOX_WEECHAT_COMPLETION_H
 
@@ -27,6 +27,8 @@
 #include "twc.h"
 #include "twc-list.h"
 #include "twc-profile.h"
+#include "twc-roster.h"
+#include "twc-worker.h"
 
 #include "twc-config.h"
 
@@ -37,6 +39,8 @@ struct t_config_section *twc_config_section_profile_default = NULL;
 
 struct t_config_option *twc_config_friend_request_message;
 struct t_config_option *twc_config_short_id_size;
+struct t_config_option *twc_config_friend_list_page_size;
+struct t_config_option *twc_config_send_budget;
 
 char *twc_profile_option_names[TWC_PROFILE_NUM_OPTIONS] =
 {
@@ -49,6 +53,14 @@ char *twc_profile_option_names[TWC_PROFILE_NUM_OPTIONS] =
     "udp",
     "ipv6",
     "passphrase",
+    "threaded",
+    "iterate_mode",
+    "coalesce_messages",
+    "queue_max_messages",
+    "queue_max_bytes",
+    "queue_total_max_messages",
+    "queue_total_max_bytes",
+    "queue_overflow",
 };
 
 /**
@@ -145,6 +157,22 @@ twc_config_check_value_callback(void *data,
     return 1;
 }
 
+/**
+ * Callback for a global option being changed.
+ */
+void
+twc_config_change_callback(void *data, struct t_config_option *option)
+{
+    size_t index;
+    struct t_twc_profile *profile;
+
+    if (option == twc_config_short_id_size)
+    {
+        twc_list_foreach(twc_profiles, index, profile, list_item)
+            twc_roster_refresh_short_ids(profile);
+    }
+}
+
 /**
  * Callback for checking an option value being set for a profile.
  */
@@ -171,6 +199,27 @@ void
 twc_config_profile_change_callback(void *data,
                                    struct t_config_option *option)
 {
+    enum t_twc_profile_option option_index = (intptr_t)data;
+
+    size_t index;
+    struct t_twc_profile *profile;
+    switch (option_index)
+    {
+        case TWC_PROFILE_OPTION_ITERATE_MODE:
+            // the default profile's option affects all profiles
+            twc_list_foreach(twc_profiles, index, profile, list_item)
+            {
+                twc_worker_lock(profile);
+                profile->iterate_mode =
+                    TWC_PROFILE_OPTION_INTEGER(profile,
+                                               TWC_PROFILE_OPTION_ITERATE_MODE);
+                twc_worker_unlock(profile);
+                twc_profile_wake(profile);
+            }
+            break;
+        default:
+            break;
+    }
 }
 
 /**
@@ -240,6 +289,70 @@ twc_config_init_option(struct t_config_section *section,
                           "WeeChat home folder and \"%p\" by profile name";
             default_value = "%h/tox/%p";
             break;
+        case TWC_PROFILE_OPTION_THREADED:
+            type = "boolean";
+            description = "run Tox for this profile on a separate thread, so "
+                          "that network activity does not slow down WeeChat; "
+                          "requires profile reload to take effect";
+            default_value = "off";
+            break;
+        case TWC_PROFILE_OPTION_ITERATE_MODE:
+            type = "integer";
+            description = "how eagerly to poll the Tox network: latency "
+                          "always iterates as often as Tox asks, balanced "
+                          "and power-save iterate less often (down to 4 and "
+                          "1 times per second) while connected and idle, "
+                          "returning to full speed on any activity";
+            string_values = "latency|balanced|power-save";
+            min = 0; max = 0;
+            default_value = "balanced";
+            break;
+        case TWC_PROFILE_OPTION_COALESCE_MESSAGES:
+            type = "boolean";
+            description = "when sending a backlog of queued messages, join "
+                          "consecutive short ones into one message, a line "
+                          "each, prefixed with the time they were written";
+            default_value = "off";
+            break;
+        case TWC_PROFILE_OPTION_QUEUE_MAX_MESSAGES:
+            type = "integer";
+            description = "maximum number of messages queued for one friend "
+                          "(0 = unlimited)";
+            min = 0; max = INT_MAX;
+            default_value = "10000";
+            break;
+        case TWC_PROFILE_OPTION_QUEUE_MAX_BYTES:
+            type = "integer";
+            description = "maximum bytes of messages queued for one friend "
+                          "(0 = unlimited)";
+            min = 0; max = INT_MAX;
+            default_value = "4194304";
+            break;
+        case TWC_PROFILE_OPTION_QUEUE_TOTAL_MAX_MESSAGES:
+            type = "integer";
+            description = "maximum number of messages queued for all friends "
+                          "(0 = unlimited)";
+            min = 0; max = INT_MAX;
+            default_value = "100000";
+            break;
+        case TWC_PROFILE_OPTION_QUEUE_TOTAL_MAX_BYTES:
+            type = "integer";
+            description = "maximum bytes of messages queued for all friends "
+                          "(0 = unlimited)";
+            min = 0; max = INT_MAX;
+            default_value = "67108864";
+            break;
+        case TWC_PROFILE_OPTION_QUEUE_OVERFLOW:
+            type = "integer";
+            description = "what to do with a new message when a queue limit "
+                          "is reached: drop-oldest drops the oldest queued "
+                          "messages (of the friend, or of all friends) to "
+                          "make room, drop-newest drops the new message, "
+                          "reject refuses it with an error";
+            string_values = "drop-oldest|drop-newest|reject";
+            min = 0; max = 0;
+            default_value = "reject";
+            break;
         case TWC_PROFILE_OPTION_UDP:
             type = "boolean";
             description = "use UDP when communicating with the Tox network";
@@ -318,7 +431,22 @@ twc_config_init()
         NULL, 2, TOX_PUBLIC_KEY_SIZE * 2,
         "8", NULL, 0,
         twc_config_check_value_callback, NULL,
-        NULL, NULL, NULL, NULL);
+        twc_config_change_callback, NULL, NULL, NULL);
+    twc_config_friend_list_page_size = weechat_config_new_option(
+        twc_config_file, twc_config_section_look,
+        "friend_list_page_size", "integer",
+        "number of friends shown per page by /friend list",
+        NULL, 1, 10000,
+        "50", NULL, 0,
+        NULL, NULL, NULL, NULL, NULL, NULL);
+    twc_config_send_budget = weechat_config_new_option(
+        twc_config_file, twc_config_section_look,
+        "send_budget", "integer",
+        "bytes of queued messages sent per profile each time the backlog "
+        "timer runs, shared fairly between friends with messages to send",
+        NULL, TOX_MAX_MESSAGE_LENGTH, 1048576,
+        "16384", NULL, 0,
+        NULL, NULL, NULL, NULL, NULL, NULL);
 }
 
 /**
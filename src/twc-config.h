@@ -24,6 +24,8 @@ struct t_twc_profile;
 
 extern struct t_config_option *twc_config_friend_request_message;
 extern struct t_config_option *twc_config_short_id_size;
+extern struct t_config_option *twc_config_friend_list_page_size;
+extern struct t_config_option *twc_config_send_budget;
 
 enum t_twc_proxy
 {
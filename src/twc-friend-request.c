@@ -25,6 +25,7 @@
 #include "twc.h"
 #include "twc-list.h"
 #include "twc-profile.h"
+#include "twc-roster.h"
 #include "twc-utils.h"
 
 #include "twc-friend-request.h"
@@ -55,8 +56,7 @@ twc_friend_request_add(struct t_twc_profile *profile,
     request->message = strdup(message);
     memcpy(request->tox_id, client_id, TOX_PUBLIC_KEY_SIZE);
 
-    if (!twc_list_item_new_data_add(profile->friend_requests, request))
-        return -2;
+    twc_list_add(profile->friend_requests, &request->list_item);
 
     return profile->friend_requests->count - 1;
 }
@@ -68,7 +68,10 @@ bool
 twc_friend_request_accept(struct t_twc_friend_request *request)
 {
     TOX_ERR_FRIEND_ADD err;
-    tox_friend_add_norequest(request->profile->tox, request->tox_id, &err);
+    uint32_t friend_number = tox_friend_add_norequest(request->profile->tox,
+                                                      request->tox_id, &err);
+    if (err == TOX_ERR_FRIEND_ADD_OK)
+        twc_roster_add(request->profile, friend_number);
     twc_friend_request_remove(request);
 
     return err == TOX_ERR_FRIEND_ADD_OK;
@@ -80,7 +83,7 @@ twc_friend_request_accept(struct t_twc_friend_request *request)
 void
 twc_friend_request_remove(struct t_twc_friend_request *request)
 {
-    twc_list_remove_with_data(request->profile->friend_requests, request);
+    twc_list_remove(&request->list_item);
 }
 
 /**
@@ -89,7 +92,8 @@ twc_friend_request_remove(struct t_twc_friend_request *request)
 struct t_twc_friend_request *
 twc_friend_request_with_index(struct t_twc_profile *profile, int64_t index)
 {
-    return twc_list_get(profile->friend_requests, index)->friend_request;
+    return twc_list_get_data(profile->friend_requests, index,
+                             struct t_twc_friend_request, list_item);
 }
 
 /**
@@ -109,7 +113,8 @@ void
 twc_friend_request_free_list(struct t_twc_list *list)
 {
     struct t_twc_friend_request *request;
-    while ((request = twc_list_pop(list)))
+    while ((request = twc_list_pop_data(list, struct t_twc_friend_request,
+                                        list_item)))
         twc_friend_request_free(request);
 
     free(list);
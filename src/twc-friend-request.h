@@ -22,7 +22,7 @@
 
 #include <tox/tox.h>
 
-struct t_twc_list;
+#include "twc-list.h"
 
 /**
  * Represents a friend request with a Tox ID and a message.
@@ -33,6 +33,8 @@ struct t_twc_friend_request
 
     uint8_t tox_id[TOX_PUBLIC_KEY_SIZE];
     char *message;
+
+    struct t_twc_list_item list_item;
 };
 
 int
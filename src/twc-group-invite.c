@@ -58,7 +58,7 @@ twc_group_chat_invite_add(struct t_twc_profile *profile,
     invite->data = data_copy;
     invite->data_size = size;
 
-    twc_list_item_new_data_add(profile->group_chat_invites, invite);
+    twc_list_add(profile->group_chat_invites, &invite->list_item);
 
     return profile->group_chat_invites->count - 1;
 }
@@ -102,7 +102,7 @@ twc_group_chat_invite_join(struct t_twc_group_chat_invite *invite)
 void
 twc_group_chat_invite_remove(struct t_twc_group_chat_invite *invite)
 {
-    twc_list_remove_with_data(invite->profile->group_chat_invites, invite);
+    twc_list_remove(&invite->list_item);
     twc_group_chat_invite_free(invite);
 }
 
@@ -113,12 +113,8 @@ struct t_twc_group_chat_invite *
 twc_group_chat_invite_with_index(struct t_twc_profile *profile,
                                  size_t index)
 {
-    struct t_twc_list_item *item =
-        twc_list_get(profile->group_chat_invites, index);
-    if (item)
-        return item->group_chat_invite;
-    else
-        return NULL;
+    return twc_list_get_data(profile->group_chat_invites, index,
+                             struct t_twc_group_chat_invite, list_item);
 }
 
 /**
@@ -138,7 +134,8 @@ void
 twc_group_chat_invite_free_list(struct t_twc_list *list)
 {
     struct t_twc_group_chat_invite *invite;
-    while ((invite = twc_list_pop(list)))
+    while ((invite = twc_list_pop_data(list, struct t_twc_group_chat_invite,
+                                       list_item)))
         twc_group_chat_invite_free(invite);
 
     free(list);
@@ -24,7 +24,7 @@
 
 #include <tox/tox.h>
 
-struct t_twc_list;
+#include "twc-list.h"
 
 /**
  * Represents a group chat invite.
@@ -37,6 +37,8 @@ struct t_twc_group_chat_invite
     uint8_t group_chat_type;
     uint8_t *data;
     size_t data_size;
+
+    struct t_twc_list_item list_item;
 };
 
 int
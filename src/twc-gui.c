@@ -28,6 +28,12 @@
 
 #include "twc-gui.h"
 
+/**
+ * Bar items waiting for an update, and the timer that will update them.
+ */
+unsigned int twc_gui_dirty_bar_items = 0;
+struct t_hook *twc_gui_bar_item_timer = NULL;
+
 char *
 twc_bar_item_away(void *data,
                   struct t_gui_bar_item *item,
@@ -41,7 +47,7 @@ twc_bar_item_away(void *data,
         return NULL;
 
     char *status;
-    switch (tox_self_get_status(profile->tox))
+    switch (profile->self_status)
     {
         case TOX_USER_STATUS_NONE:
             status = NULL;
@@ -69,7 +75,7 @@ twc_bar_item_input_prompt(void *data,
     if (!profile || !(profile->tox))
         return NULL;
 
-    return twc_get_self_name_nt(profile->tox);
+    return profile->self_name ? strdup(profile->self_name) : NULL;
 }
 
 char *
@@ -80,26 +86,64 @@ twc_bar_item_buffer_plugin(void *data, struct t_gui_bar_item *item,
 {
     struct t_twc_profile *profile = twc_profile_search_buffer(buffer);
 
-    char string[256];
-
     const char *plugin_name = weechat_plugin_get_name(weechat_plugin);
 
     if (!profile)
         return strdup(plugin_name);
 
-    const char *profile_name = profile->name;
+    // rendered once per online status change, see
+    // twc_profile_refresh_online_status
+    if (!profile->bar_item_buffer_plugin)
+    {
+        char string[256];
+        snprintf(string, sizeof(string),
+                 "%s%s/%s%s%s/%s%s",
+                 plugin_name,
+                 weechat_color("bar_delim"),
+                 weechat_color("bar_fg"),
+                 profile->name,
+                 weechat_color("bar_delim"),
+                 weechat_color("bar_fg"),
+                 profile->tox_online ? "online" : "offline");
+        profile->bar_item_buffer_plugin = strdup(string);
+    }
+
+    return strdup(profile->bar_item_buffer_plugin);
+}
+
+/**
+ * Callback for twc_gui_queue_bar_item_update. Updates the dirty bar items.
+ */
+int
+twc_gui_bar_item_timer_callback(void *data, int remaining)
+{
+    unsigned int items = twc_gui_dirty_bar_items;
+    twc_gui_dirty_bar_items = 0;
+    twc_gui_bar_item_timer = NULL;
+
+    if (items & TWC_BAR_ITEM_BUFFER_PLUGIN)
+        weechat_bar_item_update("buffer_plugin");
+    if (items & TWC_BAR_ITEM_INPUT_PROMPT)
+        weechat_bar_item_update("input_prompt");
+    if (items & TWC_BAR_ITEM_AWAY)
+        weechat_bar_item_update("away");
+
+    return WEECHAT_RC_OK;
+}
 
-    snprintf(string, sizeof(string),
-             "%s%s/%s%s%s/%s%s",
-             plugin_name,
-             weechat_color("bar_delim"),
-             weechat_color("bar_fg"),
-             profile_name,
-             weechat_color("bar_delim"),
-             weechat_color("bar_fg"),
-             profile->tox_online ? "online" : "offline");
+/**
+ * Mark bar items (a mask of enum t_twc_bar_item) as needing an update. They
+ * are updated on the next event loop tick, at most once each no matter how
+ * many times they were marked.
+ */
+void
+twc_gui_queue_bar_item_update(unsigned int items)
+{
+    twc_gui_dirty_bar_items |= items;
 
-    return strdup(string);
+    if (twc_gui_dirty_bar_items && !twc_gui_bar_item_timer)
+        twc_gui_bar_item_timer =
+            weechat_hook_timer(1, 0, 1, twc_gui_bar_item_timer_callback, NULL);
 }
 
 void twc_gui_init()
@@ -109,3 +153,11 @@ void twc_gui_init()
     weechat_bar_item_new("buffer_plugin", twc_bar_item_buffer_plugin, NULL);
 }
 
+void twc_gui_end()
+{
+    if (twc_gui_bar_item_timer)
+        weechat_unhook(twc_gui_bar_item_timer);
+    twc_gui_bar_item_timer = NULL;
+    twc_gui_dirty_bar_items = 0;
+}
+
@@ -20,7 +20,21 @@
 #ifndef TOX_WEECHAT_GUI_H
 #define TOX_WEECHAT_GUI_H
 
+enum t_twc_bar_item
+{
+    TWC_BAR_ITEM_AWAY = 1 << 0,
+    TWC_BAR_ITEM_INPUT_PROMPT = 1 << 1,
+    TWC_BAR_ITEM_BUFFER_PLUGIN = 1 << 2,
+
+    TWC_BAR_ITEM_ALL = (1 << 3) - 1,
+};
+
 void twc_gui_init();
 
+void
+twc_gui_queue_bar_item_update(unsigned int items);
+
+void twc_gui_end();
+
 #endif // TOX_WEECHAT_GUI_H
 
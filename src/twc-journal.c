@@ -0,0 +1,601 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <weechat/weechat-plugin.h>
+#include <tox/tox.h>
+
+#include "twc.h"
+#include "twc-list.h"
+#include "twc-profile.h"
+#include "twc-message-queue.h"
+#include "twc-roster.h"
+
+#include "twc-journal.h"
+
+#define TWC_JOURNAL_MAGIC "TWCJ"
+#define TWC_JOURNAL_VERSION 1
+
+enum t_twc_journal_record_type
+{
+    TWC_JOURNAL_RECORD_ENQUEUE = 1,
+    TWC_JOURNAL_RECORD_DEQUEUE = 2,
+};
+
+/**
+ * Record layouts. Every record is followed by a checksum of its bytes, and
+ * an enqueue record by the message text.
+ */
+struct t_twc_journal_enqueue
+{
+    uint8_t type;
+    uint8_t message_type;
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    int64_t time;
+    uint32_t length;
+} __attribute__((packed));
+
+struct t_twc_journal_dequeue
+{
+    uint8_t type;
+    uint32_t record;
+} __attribute__((packed));
+
+#define TWC_JOURNAL_HEADER_SIZE (sizeof(TWC_JOURNAL_MAGIC) - 1 + sizeof(uint32_t))
+#define TWC_JOURNAL_ENQUEUE_SIZE(length) \
+    (sizeof(struct t_twc_journal_enqueue) + (length) + sizeof(uint32_t))
+
+/**
+ * FNV-1a hash of two consecutive byte ranges.
+ */
+uint32_t
+twc_journal_checksum(const void *header, size_t header_size,
+                     const void *body, size_t body_size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < header_size; ++i)
+        hash = (hash ^ ((const uint8_t *)header)[i]) * 16777619u;
+    for (size_t i = 0; i < body_size; ++i)
+        hash = (hash ^ ((const uint8_t *)body)[i]) * 16777619u;
+
+    return hash;
+}
+
+/**
+ * Write a record with a single system call. Returns the number of bytes
+ * written, or -1 on error.
+ */
+ssize_t
+twc_journal_write_record(int fd, const void *header, size_t header_size,
+                         const void *body, size_t body_size)
+{
+    uint32_t checksum = twc_journal_checksum(header, header_size,
+                                             body, body_size);
+    struct iovec iov[3] = {
+        { .iov_base = (void *)header, .iov_len = header_size },
+        { .iov_base = (void *)body, .iov_len = body_size },
+        { .iov_base = &checksum, .iov_len = sizeof(checksum) },
+    };
+
+    size_t size = header_size + body_size + sizeof(checksum);
+    ssize_t written = writev(fd, iov, 3);
+    return written == (ssize_t)size ? written : -1;
+}
+
+/**
+ * Write the enqueue record of a message. Returns the number of bytes
+ * written, or -1 on error.
+ */
+ssize_t
+twc_journal_write_enqueue(int fd, const uint8_t *public_key,
+                          struct t_twc_message_queue *message_queue,
+                          struct t_twc_queued_message *message)
+{
+    struct t_twc_journal_enqueue record;
+    record.type = TWC_JOURNAL_RECORD_ENQUEUE;
+    record.message_type = message->message_type;
+    memcpy(record.public_key, public_key, TOX_PUBLIC_KEY_SIZE);
+    record.time = message->time;
+    record.length = message->length;
+
+    return twc_journal_write_record(fd, &record, sizeof(record),
+                                    twc_message_queue_text(message_queue,
+                                                           message),
+                                    record.length);
+}
+
+/**
+ * Get the path of a profile's journal. Returned string must be freed.
+ */
+char *
+twc_journal_path(struct t_twc_profile *profile)
+{
+    char *data_path = twc_profile_expanded_data_path(profile);
+    char *path = malloc(strlen(data_path) + sizeof(".journal"));
+    sprintf(path, "%s.journal", data_path);
+    free(data_path);
+
+    return path;
+}
+
+/**
+ * Report a journal error and stop journaling. Queued messages are still
+ * kept in memory.
+ */
+void
+twc_journal_fail(struct t_twc_profile *profile, const char *action)
+{
+    weechat_printf(profile->buffer,
+                   "%s%s: could not %s message journal %s; queued messages "
+                   "will not survive a restart",
+                   weechat_prefix("error"), weechat_plugin->name,
+                   action, profile->journal->path);
+    twc_journal_close(profile);
+}
+
+/**
+ * Replay the records in a journal, queueing every message that was not
+ * dequeued. Stops at the first torn or corrupted record, which can only be
+ * the tail of a write interrupted by a crash.
+ *
+ * Returns TWC_RC_ERROR_MALLOC if the records could not be indexed, having
+ * queued nothing, or if a message could not be queued.
+ */
+enum t_twc_rc
+twc_journal_replay(struct t_twc_profile *profile, const uint8_t *data,
+                   size_t size)
+{
+    if (size < TWC_JOURNAL_HEADER_SIZE
+        || memcmp(data, TWC_JOURNAL_MAGIC, sizeof(TWC_JOURNAL_MAGIC) - 1) != 0)
+        return TWC_RC_OK;
+
+    uint32_t version;
+    memcpy(&version, data + sizeof(TWC_JOURNAL_MAGIC) - 1, sizeof(version));
+    if (version != TWC_JOURNAL_VERSION)
+        return TWC_RC_OK;
+
+    // offsets of enqueue records by record number, 0 once dequeued
+    size_t records_size = 64;
+    size_t records_count = 0;
+    size_t *records = malloc(sizeof(size_t) * records_size);
+    if (!records)
+        return TWC_RC_ERROR_MALLOC;
+
+    size_t offset = TWC_JOURNAL_HEADER_SIZE;
+    while (offset < size)
+    {
+        uint8_t type = data[offset];
+        size_t header_size, body_size = 0;
+        if (type == TWC_JOURNAL_RECORD_ENQUEUE)
+        {
+            header_size = sizeof(struct t_twc_journal_enqueue);
+            if (size - offset >= header_size)
+            {
+                struct t_twc_journal_enqueue record;
+                memcpy(&record, data + offset, sizeof(record));
+                body_size = record.length;
+            }
+        }
+        else if (type == TWC_JOURNAL_RECORD_DEQUEUE)
+        {
+            header_size = sizeof(struct t_twc_journal_dequeue);
+        }
+        else
+        {
+            break;
+        }
+
+        size_t record_size = header_size + body_size + sizeof(uint32_t);
+        if (size - offset < header_size || size - offset < record_size)
+            break;
+
+        uint32_t checksum;
+        memcpy(&checksum, data + offset + header_size + body_size,
+               sizeof(checksum));
+        if (checksum != twc_journal_checksum(data + offset, header_size,
+                                             data + offset + header_size,
+                                             body_size))
+            break;
+
+        if (type == TWC_JOURNAL_RECORD_ENQUEUE)
+        {
+            if (records_count == records_size)
+            {
+                size_t *new_records =
+                    realloc(records, sizeof(size_t) * records_size * 2);
+                if (!new_records)
+                {
+                    free(records);
+                    return TWC_RC_ERROR_MALLOC;
+                }
+                records = new_records;
+                records_size *= 2;
+            }
+            records[records_count++] = offset;
+        }
+        else
+        {
+            struct t_twc_journal_dequeue record;
+            memcpy(&record, data + offset, sizeof(record));
+            if (record.record < records_count)
+                records[record.record] = 0;
+        }
+
+        offset += record_size;
+    }
+
+    enum t_twc_rc rc = TWC_RC_OK;
+    size_t restored = 0, dropped = 0;
+    for (size_t i = 0; i < records_count; ++i)
+    {
+        if (!records[i])
+            continue;
+
+        struct t_twc_journal_enqueue record;
+        memcpy(&record, data + records[i], sizeof(record));
+
+        struct t_twc_friend *friend =
+            twc_roster_search_key(profile, record.public_key);
+        if (!friend)
+        {
+            ++dropped;
+            continue;
+        }
+
+        rc = twc_message_queue_restore_friend_message(profile,
+                                                      friend->friend_number,
+                                                      (const char *)data + records[i]
+                                                      + sizeof(record),
+                                                      record.length,
+                                                      (enum TWC_MESSAGE_TYPE)record.message_type,
+                                                      record.time);
+        if (rc != TWC_RC_OK)
+            break;
+        ++restored;
+    }
+    free(records);
+
+    if (restored > 0)
+        weechat_printf(profile->buffer,
+                       "%s%s: restored %zu queued message(s)",
+                       weechat_prefix("network"), weechat_plugin->name,
+                       restored);
+    if (dropped > 0)
+        weechat_printf(profile->buffer,
+                       "%s%s: dropped %zu queued message(s) to removed friends",
+                       weechat_prefix("error"), weechat_plugin->name,
+                       dropped);
+
+    return rc;
+}
+
+struct t_twc_journal_compact_data
+{
+    struct t_twc_profile *profile;
+    int fd;
+    size_t size;
+    uint32_t next_record;
+    bool failed;
+};
+
+/**
+ * Write the enqueue records of a friend's undelivered messages to a new
+ * journal.
+ */
+void
+twc_journal_compact_queue(struct t_twc_journal_compact_data *compact,
+                          struct t_twc_message_queue *message_queue)
+{
+    struct t_twc_friend *friend = twc_roster_get(compact->profile,
+                                                 message_queue->friend_number);
+    if (compact->failed)
+        return;
+
+    for (size_t i = 0; i < message_queue->messages_count; ++i)
+    {
+        struct t_twc_queued_message *message =
+            twc_message_queue_at(message_queue, message_queue->first_seq + i);
+
+        // records in the old journal are gone once it is replaced
+        if (!friend || message->chunks_delivered == message->chunk_count)
+        {
+            message->journal_record = TWC_MESSAGE_QUEUE_NO_RECORD;
+            continue;
+        }
+
+        ssize_t written = twc_journal_write_enqueue(compact->fd,
+                                                    friend->public_key,
+                                                    message_queue, message);
+        if (written < 0)
+        {
+            compact->failed = true;
+            return;
+        }
+
+        message->journal_record = compact->next_record++;
+        compact->size += written;
+    }
+}
+
+/**
+ * Rewrite a journal with only the messages currently queued, replacing the
+ * old file atomically.
+ */
+enum t_twc_rc
+twc_journal_compact(struct t_twc_profile *profile)
+{
+    struct t_twc_journal *journal = profile->journal;
+
+    char *tmp_path = malloc(strlen(journal->path) + sizeof(".tmp"));
+    sprintf(tmp_path, "%s.tmp", journal->path);
+
+    struct t_twc_journal_compact_data compact = {
+        .profile = profile,
+        .fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600),
+        .size = TWC_JOURNAL_HEADER_SIZE,
+        .next_record = 0,
+        .failed = false,
+    };
+    if (compact.fd == -1)
+    {
+        free(tmp_path);
+        return TWC_RC_ERROR;
+    }
+
+    uint8_t header[TWC_JOURNAL_HEADER_SIZE];
+    uint32_t version = TWC_JOURNAL_VERSION;
+    memcpy(header, TWC_JOURNAL_MAGIC, sizeof(TWC_JOURNAL_MAGIC) - 1);
+    memcpy(header + sizeof(TWC_JOURNAL_MAGIC) - 1, &version, sizeof(version));
+    compact.failed = write(compact.fd, header, sizeof(header))
+                     != (ssize_t)sizeof(header);
+
+    for (size_t i = 0; i < profile->message_queues_size; ++i)
+    {
+        if (profile->message_queues[i])
+            twc_journal_compact_queue(&compact, profile->message_queues[i]);
+    }
+
+    if (compact.failed || fsync(compact.fd) != 0
+        || close(compact.fd) != 0 || rename(tmp_path, journal->path) != 0)
+    {
+        unlink(tmp_path);
+        free(tmp_path);
+        return TWC_RC_ERROR;
+    }
+    free(tmp_path);
+
+    if (journal->fd != -1)
+        close(journal->fd);
+    journal->fd = open(journal->path, O_WRONLY | O_APPEND);
+    if (journal->fd == -1)
+        return TWC_RC_ERROR;
+
+    journal->size = compact.size;
+    journal->live_size = compact.size - TWC_JOURNAL_HEADER_SIZE;
+    journal->next_record = compact.next_record;
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Callback for the journal sync timer. Flushes records written since the
+ * last sync to disk, and compacts the journal if it is mostly dead records.
+ */
+int
+twc_journal_sync_timer_callback(void *data, int remaining)
+{
+    struct t_twc_profile *profile = data;
+    struct t_twc_journal *journal = profile->journal;
+    journal->sync_timer = NULL;
+
+    if (fdatasync(journal->fd) != 0)
+    {
+        twc_journal_fail(profile, "sync");
+        return WEECHAT_RC_OK;
+    }
+
+    if (journal->size > TWC_JOURNAL_COMPACT_SIZE
+        && journal->size > 2 * journal->live_size
+        && twc_journal_compact(profile) != TWC_RC_OK)
+    {
+        twc_journal_fail(profile, "compact");
+    }
+
+    return WEECHAT_RC_OK;
+}
+
+/**
+ * Account for a record appended to the journal, and make sure a sync is
+ * scheduled.
+ */
+void
+twc_journal_appended(struct t_twc_profile *profile, ssize_t written)
+{
+    struct t_twc_journal *journal = profile->journal;
+    if (written < 0)
+    {
+        twc_journal_fail(profile, "write to");
+        return;
+    }
+
+    journal->size += written;
+    if (!journal->sync_timer)
+        journal->sync_timer = weechat_hook_timer(TWC_JOURNAL_SYNC_INTERVAL,
+                                                 0, 1,
+                                                 twc_journal_sync_timer_callback,
+                                                 profile);
+}
+
+/**
+ * Open a profile's journal. If no messages are queued in memory, those in
+ * the journal are queued; otherwise the memory is more recent. Either way,
+ * the journal is then rewritten from the queue.
+ *
+ * The journal is not kept for profiles with a passphrase, as it would store
+ * messages in plain text.
+ */
+enum t_twc_rc
+twc_journal_open(struct t_twc_profile *profile)
+{
+    if (profile->journal)
+        return TWC_RC_OK;
+
+    const char *pw = weechat_config_string(profile->options[TWC_PROFILE_OPTION_PASSPHRASE]);
+    if (pw && pw[0])
+        return TWC_RC_OK;
+
+    struct t_twc_journal *journal = malloc(sizeof(struct t_twc_journal));
+    if (!journal)
+        return TWC_RC_ERROR_MALLOC;
+
+    journal->path = twc_journal_path(profile);
+    journal->fd = -1;
+    journal->size = journal->live_size = 0;
+    journal->next_record = 0;
+    journal->sync_timer = NULL;
+    profile->journal = journal;
+
+    if (profile->queued_message_count == 0)
+    {
+        enum t_twc_rc rc = TWC_RC_OK;
+        int fd = open(journal->path, O_RDONLY);
+        struct stat st;
+        if (fd == -1)
+        {
+            // no journal yet
+            if (errno != ENOENT)
+                rc = TWC_RC_ERROR;
+        }
+        else if (fstat(fd, &st) != 0)
+        {
+            rc = TWC_RC_ERROR;
+        }
+        else if (st.st_size > 0)
+        {
+            size_t size = st.st_size;
+            uint8_t *data = malloc(size);
+            if (!data)
+                rc = TWC_RC_ERROR_MALLOC;
+            else if (read(fd, data, size) != (ssize_t)size)
+                rc = TWC_RC_ERROR;
+            else
+                rc = twc_journal_replay(profile, data, size);
+            free(data);
+        }
+        if (fd != -1)
+            close(fd);
+
+        // leave the journal on disk untouched rather than compact it
+        // without the messages that could not be replayed
+        if (rc != TWC_RC_OK)
+        {
+            twc_journal_fail(profile, "read");
+            return rc;
+        }
+    }
+
+    if (twc_journal_compact(profile) != TWC_RC_OK)
+    {
+        twc_journal_fail(profile, "write");
+        return TWC_RC_ERROR;
+    }
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Record that a message was queued for a friend.
+ */
+void
+twc_journal_enqueue(struct t_twc_profile *profile,
+                    struct t_twc_message_queue *message_queue,
+                    struct t_twc_queued_message *message)
+{
+    struct t_twc_journal *journal = profile->journal;
+    struct t_twc_friend *friend = twc_roster_get(profile,
+                                                 message_queue->friend_number);
+    if (!journal || !friend)
+        return;
+
+    ssize_t written = twc_journal_write_enqueue(journal->fd,
+                                                friend->public_key,
+                                                message_queue, message);
+    if (written > 0)
+    {
+        message->journal_record = journal->next_record++;
+        journal->live_size += written;
+    }
+    twc_journal_appended(profile, written);
+}
+
+/**
+ * Record that a queued message was delivered.
+ */
+void
+twc_journal_dequeue(struct t_twc_profile *profile,
+                    struct t_twc_message_queue *message_queue,
+                    struct t_twc_queued_message *message)
+{
+    struct t_twc_journal *journal = profile->journal;
+    if (!journal || message->journal_record == TWC_MESSAGE_QUEUE_NO_RECORD)
+        return;
+
+    struct t_twc_journal_dequeue record;
+    record.type = TWC_JOURNAL_RECORD_DEQUEUE;
+    record.record = message->journal_record;
+
+    ssize_t written = twc_journal_write_record(journal->fd,
+                                               &record, sizeof(record),
+                                               NULL, 0);
+    if (written > 0)
+        journal->live_size -= TWC_JOURNAL_ENQUEUE_SIZE(message->length);
+    twc_journal_appended(profile, written);
+}
+
+/**
+ * Sync and close a profile's journal.
+ */
+void
+twc_journal_close(struct t_twc_profile *profile)
+{
+    struct t_twc_journal *journal = profile->journal;
+    if (!journal)
+        return;
+
+    if (journal->sync_timer)
+        weechat_unhook(journal->sync_timer);
+    if (journal->fd != -1)
+    {
+        fdatasync(journal->fd);
+        close(journal->fd);
+    }
+
+    free(journal->path);
+    free(journal);
+    profile->journal = NULL;
+}
+
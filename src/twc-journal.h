@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TOX_WEECHAT_JOURNAL_H
+#define TOX_WEECHAT_JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "twc.h"
+
+struct t_twc_profile;
+struct t_twc_message_queue;
+struct t_twc_queued_message;
+
+/**
+ * Journal records grow the file by at least this many bytes before it is
+ * considered for compaction.
+ */
+#define TWC_JOURNAL_COMPACT_SIZE (64 * 1024)
+
+/**
+ * Milliseconds between an append and the fsync covering it.
+ */
+#define TWC_JOURNAL_SYNC_INTERVAL 1000
+
+/**
+ * An append-only log of a profile's queued messages, kept next to its save
+ * file. Every queued message has an enqueue record, and a dequeue record
+ * once delivered; records are numbered in the order they were written, and
+ * a dequeue refers to its enqueue by that number. size is the file size and
+ * live_size the size of enqueue records not dequeued yet.
+ */
+struct t_twc_journal
+{
+    char *path;
+    int fd;
+
+    size_t size;
+    size_t live_size;
+    uint32_t next_record;
+
+    struct t_hook *sync_timer;
+};
+
+char *
+twc_journal_path(struct t_twc_profile *profile);
+
+enum t_twc_rc
+twc_journal_open(struct t_twc_profile *profile);
+
+void
+twc_journal_enqueue(struct t_twc_profile *profile,
+                    struct t_twc_message_queue *message_queue,
+                    struct t_twc_queued_message *message);
+
+void
+twc_journal_dequeue(struct t_twc_profile *profile,
+                    struct t_twc_message_queue *message_queue,
+                    struct t_twc_queued_message *message);
+
+void
+twc_journal_close(struct t_twc_profile *profile);
+
+#endif // TOX_WEECHAT_JOURNAL_H
+
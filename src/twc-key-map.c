@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <tox/tox.h>
+
+#include "twc.h"
+
+#include "twc-key-map.h"
+
+#define TWC_KEY_MAP_MIN_SIZE 16
+
+/**
+ * Return the home slot of a key. Public keys are uniformly random, so their
+ * first bytes make a perfectly good hash.
+ */
+size_t
+twc_key_map_slot(struct t_twc_key_map *map, const uint8_t *key)
+{
+    uint64_t hash;
+    memcpy(&hash, key, sizeof(hash));
+
+    return hash & (map->size - 1);
+}
+
+/**
+ * Return the slot holding key, or the empty slot where it would be inserted.
+ */
+struct t_twc_key_map_entry *
+twc_key_map_find(struct t_twc_key_map *map, const uint8_t *key)
+{
+    size_t slot = twc_key_map_slot(map, key);
+    for (;;)
+    {
+        struct t_twc_key_map_entry *entry = &map->entries[slot];
+        if (!entry->value
+            || memcmp(entry->key, key, TOX_PUBLIC_KEY_SIZE) == 0)
+            return entry;
+
+        slot = (slot + 1) & (map->size - 1);
+    }
+}
+
+/**
+ * Allocate a slot array with room for size entries (a power of two).
+ */
+enum t_twc_rc
+twc_key_map_alloc(struct t_twc_key_map *map, size_t size)
+{
+    map->entries = calloc(size, sizeof(struct t_twc_key_map_entry));
+    if (!map->entries)
+        return TWC_RC_ERROR_MALLOC;
+
+    map->size = size;
+    map->count = 0;
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Create a new key map with room for at least size keys before growing.
+ */
+struct t_twc_key_map *
+twc_key_map_new(size_t size)
+{
+    struct t_twc_key_map *map = malloc(sizeof(struct t_twc_key_map));
+    if (!map)
+        return NULL;
+
+    size_t real_size = TWC_KEY_MAP_MIN_SIZE;
+    while (real_size * 3 / 4 < size)
+        real_size *= 2;
+
+    if (twc_key_map_alloc(map, real_size) != TWC_RC_OK)
+    {
+        free(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+/**
+ * Double the size of a key map, rehashing all keys.
+ */
+enum t_twc_rc
+twc_key_map_grow(struct t_twc_key_map *map)
+{
+    struct t_twc_key_map_entry *old_entries = map->entries;
+    size_t old_size = map->size;
+
+    if (twc_key_map_alloc(map, old_size * 2) != TWC_RC_OK)
+    {
+        map->entries = old_entries;
+        return TWC_RC_ERROR_MALLOC;
+    }
+
+    for (size_t i = 0; i < old_size; ++i)
+    {
+        if (old_entries[i].value)
+        {
+            *twc_key_map_find(map, old_entries[i].key) = old_entries[i];
+            ++(map->count);
+        }
+    }
+
+    free(old_entries);
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Get the value associated with a key, or NULL.
+ */
+void *
+twc_key_map_get(struct t_twc_key_map *map, const uint8_t *key)
+{
+    return twc_key_map_find(map, key)->value;
+}
+
+/**
+ * Associate a key with a value, replacing any previous value. value must not
+ * be NULL.
+ */
+enum t_twc_rc
+twc_key_map_set(struct t_twc_key_map *map, const uint8_t *key, void *value)
+{
+    struct t_twc_key_map_entry *entry = twc_key_map_find(map, key);
+    if (entry->value)
+    {
+        entry->value = value;
+        return TWC_RC_OK;
+    }
+
+    // keep load factor below 3/4 so probe sequences stay short
+    if ((map->count + 1) * 4 > map->size * 3)
+    {
+        if (twc_key_map_grow(map) != TWC_RC_OK)
+            return TWC_RC_ERROR_MALLOC;
+        entry = twc_key_map_find(map, key);
+    }
+
+    memcpy(entry->key, key, TOX_PUBLIC_KEY_SIZE);
+    entry->value = value;
+    ++(map->count);
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Remove a key from the map. Returns the value it was associated with, or
+ * NULL if it was not found.
+ */
+void *
+twc_key_map_remove(struct t_twc_key_map *map, const uint8_t *key)
+{
+    struct t_twc_key_map_entry *entry = twc_key_map_find(map, key);
+    void *value = entry->value;
+    if (!value)
+        return NULL;
+
+    // shift following entries back into the hole so that no probe sequence
+    // is interrupted by it (no tombstones needed)
+    size_t mask = map->size - 1;
+    size_t hole = entry - map->entries;
+    size_t slot = hole;
+    for (;;)
+    {
+        slot = (slot + 1) & mask;
+        struct t_twc_key_map_entry *next = &map->entries[slot];
+        if (!next->value)
+            break;
+
+        size_t home = twc_key_map_slot(map, next->key);
+        if (((slot - home) & mask) >= ((slot - hole) & mask))
+        {
+            map->entries[hole] = *next;
+            hole = slot;
+        }
+    }
+
+    map->entries[hole].value = NULL;
+    --(map->count);
+
+    return value;
+}
+
+/**
+ * Free a key map. Does not free the values.
+ */
+void
+twc_key_map_free(struct t_twc_key_map *map)
+{
+    free(map->entries);
+    free(map);
+}
+
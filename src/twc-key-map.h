@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TOX_WEECHAT_KEY_MAP_H
+#define TOX_WEECHAT_KEY_MAP_H
+
+#include <stdlib.h>
+
+#include <tox/tox.h>
+
+#include "twc.h"
+
+/**
+ * A slot in a key map. Keys are stored inline; a NULL value marks an empty
+ * slot.
+ */
+struct t_twc_key_map_entry
+{
+    uint8_t key[TOX_PUBLIC_KEY_SIZE];
+    void *value;
+};
+
+/**
+ * Open-addressing hash map from Tox public keys to non-NULL pointers.
+ */
+struct t_twc_key_map
+{
+    size_t size;
+    size_t count;
+    struct t_twc_key_map_entry *entries;
+};
+
+struct t_twc_key_map *
+twc_key_map_new(size_t size);
+
+void *
+twc_key_map_get(struct t_twc_key_map *map, const uint8_t *key);
+
+enum t_twc_rc
+twc_key_map_set(struct t_twc_key_map *map, const uint8_t *key, void *value);
+
+void *
+twc_key_map_remove(struct t_twc_key_map *map, const uint8_t *key);
+
+void
+twc_key_map_free(struct t_twc_key_map *map);
+
+#endif // TOX_WEECHAT_KEY_MAP_H
+
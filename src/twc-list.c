@@ -33,51 +33,6 @@ twc_list_new()
     return list;
 }
 
-/**
- * Create and return a new list item.
- */
-struct t_twc_list_item *
-twc_list_item_new()
-{
-    struct t_twc_list_item *item = malloc(sizeof(struct t_twc_list_item));
-
-    return item;
-}
-
-/**
- * Create and return a new list item with data.
- */
-struct t_twc_list_item *
-twc_list_item_new_data(const void *data)
-{
-    struct t_twc_list_item *item = twc_list_item_new();
-    item->data = (void *)data;
-
-    return item;
-}
-
-/**
- * Create a new list item, add it to a list and return the item.
- */
-struct t_twc_list_item *
-twc_list_item_new_add(struct t_twc_list *list)
-{
-    struct t_twc_list_item *item = twc_list_item_new();
-    twc_list_add(list, item);
-    return item;
-}
-
-/**
- * Create a new list item with data, add it to a list and return the item.
- */
-struct t_twc_list_item *
-twc_list_item_new_data_add(struct t_twc_list *list, const void *data)
-{
-    struct t_twc_list_item *item = twc_list_item_new_data(data);
-    twc_list_add(list, item);
-    return item;
-}
-
 /**
  * Add an item to the list.
  */
@@ -101,15 +56,14 @@ twc_list_add(struct t_twc_list *list,
 }
 
 /**
- * Remove an item from the list it's in. Frees the item, but not the data
- * associated with it.
- *
- * Returns the data of the removed item.
+ * Remove an item from the list it's in, if any. Does not free anything.
  */
-void *
+void
 twc_list_remove(struct t_twc_list_item *item)
 {
     struct t_twc_list *list = item->list;
+    if (!list)
+        return;
 
     if (item == list->tail)
         list->tail = item->prev_item;
@@ -124,43 +78,22 @@ twc_list_remove(struct t_twc_list_item *item)
 
     --(list->count);
 
-    void *data = item->data;
-
-    free(item);
-
-    return data;
-}
-
-/**
- * Remove an item with the given data from the list. Frees the item, but not
- * the data.
- */
-void
-twc_list_remove_with_data(struct t_twc_list *list, const void *data)
-{
-    size_t index;
-    struct t_twc_list_item *item;
-    twc_list_foreach(list, index, item)
-    {
-        if (item->data == data)
-        {
-            twc_list_remove(item);
-            break;
-        }
-    }
+    item->list = NULL;
+    item->next_item = item->prev_item = NULL;
 }
 
 /**
- * Remove the last item from the list. Frees the item, and returns the data
- * associated with it.
+ * Remove the last item from the list and return it, or NULL if the list is
+ * empty.
  */
-void *
+struct t_twc_list_item *
 twc_list_pop(struct t_twc_list *list)
 {
-    if (list->tail)
-        return twc_list_remove(list->tail);
-    else
-        return NULL;
+    struct t_twc_list_item *item = list->tail;
+    if (item)
+        twc_list_remove(item);
+
+    return item;
 }
 
 /**
@@ -169,28 +102,22 @@ twc_list_pop(struct t_twc_list *list)
 struct t_twc_list_item *
 twc_list_get(struct t_twc_list *list, size_t index)
 {
-    if (index > list->count)
+    if (index >= list->count)
         return NULL;
 
-    size_t current_index;
     struct t_twc_list_item *item;
-    if (list->count - index > index / 2)
+    if (index < list->count / 2)
     {
-        twc_list_foreach(list, current_index, item)
-        {
-            if (current_index == index)
-                return item;
-        }
+        for (item = list->head; index > 0; --index)
+            item = item->next_item;
     }
     else
     {
-        twc_list_foreach_reverse(list, current_index, item)
-        {
-            if (current_index == index)
-                return item;
-        }
+        for (item = list->tail, index = list->count - 1 - index;
+             index > 0; --index)
+            item = item->prev_item;
     }
 
-    return NULL;
+    return item;
 }
 
@@ -21,6 +21,7 @@
 #define TOX_WEECHAT_LIST_H
 
 #include <stdlib.h>
+#include <stddef.h>
 
 struct t_twc_list
 {
@@ -29,22 +30,14 @@ struct t_twc_list
     struct t_twc_list_item *tail;
 };
 
+/**
+ * List links. Embedded in every object that can be stored in a list, so
+ * adding and removing objects never allocates or searches.
+ */
 struct t_twc_list_item
 {
     struct t_twc_list *list;
 
-    // don't know if this is a good idea
-    // probably not
-    union
-    {
-        void *data;
-        struct t_twc_profile *profile;
-        struct t_twc_friend_request *friend_request;
-        struct t_twc_group_chat_invite *group_chat_invite;
-        struct t_twc_chat *chat;
-        struct t_twc_queued_message *queued_message;
-    };
-
     struct t_twc_list_item *next_item;
     struct t_twc_list_item *prev_item;
 };
@@ -52,42 +45,70 @@ struct t_twc_list_item
 struct t_twc_list *
 twc_list_new();
 
-struct t_twc_list_item *
-twc_list_item_new();
+void
+twc_list_add(struct t_twc_list *list, struct t_twc_list_item *item);
 
-struct t_twc_list_item *
-twc_list_item_new_data(const void *data);
+void
+twc_list_remove(struct t_twc_list_item *item);
 
 struct t_twc_list_item *
-twc_list_item_new_add(struct t_twc_list *list);
+twc_list_pop(struct t_twc_list *list);
 
 struct t_twc_list_item *
-twc_list_item_new_data_add(struct t_twc_list *list, const void *data);
+twc_list_get(struct t_twc_list *list, size_t index);
 
-void
-twc_list_add(struct t_twc_list *list, struct t_twc_list_item *item);
+/**
+ * Return the object containing a list item, given the offset of the item in
+ * the object. Returns NULL for a NULL item.
+ */
+static inline void *
+twc_list_item_object(const struct t_twc_list_item *item, size_t offset)
+{
+    return item ? (char *)item - offset : NULL;
+}
 
-void *
-twc_list_remove(struct t_twc_list_item *item);
+/**
+ * Get the object of type type that embeds item as member, or NULL.
+ */
+#define twc_list_data(item, type, member) \
+    ((type *)twc_list_item_object(item, offsetof(type, member)))
 
-void
-twc_list_remove_with_data(struct t_twc_list *list, const void *data);
+#define twc_list_pop_data(list, type, member) \
+    twc_list_data(twc_list_pop(list), type, member)
 
-void *
-twc_list_pop(struct t_twc_list *list);
+#define twc_list_get_data(list, index, type, member) \
+    twc_list_data(twc_list_get(list, index), type, member)
 
-struct t_twc_list_item *
-twc_list_get(struct t_twc_list *list, size_t index);
+#define twc_list_next_data(object, member) \
+    twc_list_data((object)->member.next_item, __typeof__(*(object)), member)
 
-#define twc_list_foreach(list, index, item) \
-    for (item = list->head, index = 0; \
-         item; \
-         item = item->next_item, ++index)
+#define twc_list_prev_data(object, member) \
+    twc_list_data((object)->member.prev_item, __typeof__(*(object)), member)
 
-#define twc_list_foreach_reverse(list, index, item) \
-    for (item = list->tail, index = list->count - 1; \
-         item; \
-         item = item->prev_item, --index)
+#define twc_list_foreach(list, index, object, member) \
+    for (object = twc_list_data((list)->head, __typeof__(*(object)), member), \
+         index = 0; \
+         object; \
+         object = twc_list_next_data(object, member), ++index)
+
+/**
+ * Like twc_list_foreach, but object may be removed from the list (and freed)
+ * inside the loop.
+ */
+#define twc_list_foreach_safe(list, index, object, next, member) \
+    for (object = twc_list_data((list)->head, __typeof__(*(object)), member), \
+         next = object ? twc_list_next_data(object, member) : NULL, \
+         index = 0; \
+         object; \
+         object = next, \
+         next = object ? twc_list_next_data(object, member) : NULL, \
+         ++index)
+
+#define twc_list_foreach_reverse(list, index, object, member) \
+    for (object = twc_list_data((list)->tail, __typeof__(*(object)), member), \
+         index = (list)->count - 1; \
+         object; \
+         object = twc_list_prev_data(object, member), --index)
 
 #endif // TOX_WEECHAT_LIST_H
 
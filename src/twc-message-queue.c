@@ -25,127 +25,1101 @@
 #include "twc.h"
 #include "twc-list.h"
 #include "twc-profile.h"
+#include "twc-chat.h"
+#include "twc-config.h"
+#include "twc-journal.h"
+#include "twc-roster.h"
 #include "twc-utils.h"
+#include "twc-worker.h"
 
 #include "twc-message-queue.h"
 
+#define TWC_MESSAGE_QUEUE_ALIGN(size) (((size) + 3) & ~(size_t)3)
+
+/**
+ * Identifies queued messages, so their lines can be found again.
+ */
+uint64_t twc_message_queue_next_id = 0;
+
+/**
+ * Get the message queue for a friend, or NULL if there is none.
+ */
+struct t_twc_message_queue *
+twc_message_queue_get(struct t_twc_profile *profile, int32_t friend_number)
+{
+    if (friend_number < 0 || (size_t)friend_number >= profile->message_queues_size)
+        return NULL;
+
+    return profile->message_queues[friend_number];
+}
+
 /**
  * Get a message queue for a friend, or create one if it does not exist.
  */
-struct t_twc_list *
+struct t_twc_message_queue *
 twc_message_queue_get_or_create(struct t_twc_profile *profile,
                                 int32_t friend_number)
 {
-    struct t_twc_list *message_queue = weechat_hashtable_get(profile->message_queues, &friend_number);
-    if (!message_queue)
+    struct t_twc_message_queue *message_queue
+        = twc_message_queue_get(profile, friend_number);
+    if (message_queue)
+        return message_queue;
+
+    // friend numbers are dense, so index queues by them directly
+    if ((size_t)friend_number >= profile->message_queues_size)
     {
-        message_queue = twc_list_new();
-        weechat_hashtable_set(profile->message_queues,
-                              &friend_number,
-                              message_queue);
+        size_t size = profile->message_queues_size
+                      ? profile->message_queues_size : 16;
+        while (size <= (size_t)friend_number)
+            size *= 2;
+
+        struct t_twc_message_queue **message_queues
+            = realloc(profile->message_queues,
+                      sizeof(struct t_twc_message_queue *) * size);
+        if (!message_queues)
+            return NULL;
+        memset(message_queues + profile->message_queues_size, 0,
+               sizeof(struct t_twc_message_queue *)
+               * (size - profile->message_queues_size));
+        profile->message_queues = message_queues;
+        profile->message_queues_size = size;
     }
 
+    message_queue = calloc(1, sizeof(struct t_twc_message_queue));
+    if (!message_queue)
+        return NULL;
+    message_queue->friend_number = friend_number;
+    profile->message_queues[friend_number] = message_queue;
+
     return message_queue;
 }
 
 /**
- * Add a friend message to the message queue and tries to send it if the
- * friend is online. Handles splitting of messages. (TODO: actually split messages)
+ * Return the message with a sequence number. The pointer is valid until a
+ * message is added to the queue.
+ */
+struct t_twc_queued_message *
+twc_message_queue_at(struct t_twc_message_queue *message_queue, uint64_t seq)
+{
+    size_t index = seq - message_queue->first_seq;
+    if (seq < message_queue->first_seq || index >= message_queue->messages_count)
+        return NULL;
+
+    return &message_queue->messages[(message_queue->messages_head + index)
+                                    & (message_queue->messages_size - 1)];
+}
+
+/**
+ * Return the text of a queued message. It is not null-terminated.
+ */
+const char *
+twc_message_queue_text(struct t_twc_message_queue *message_queue,
+                       struct t_twc_queued_message *message)
+{
+    return (const char *)message_queue->arena.data
+           + (message->offset - message_queue->arena.base);
+}
+
+/**
+ * Return the bytes of message text a queue holds.
+ */
+size_t
+twc_message_queue_bytes(struct t_twc_message_queue *message_queue)
+{
+    return message_queue->arena.end - message_queue->arena.start;
+}
+
+/**
+ * Return the memory allocated for a queue.
+ */
+size_t
+twc_message_queue_memory(struct t_twc_message_queue *message_queue)
+{
+    return sizeof(struct t_twc_message_queue)
+           + message_queue->messages_size * sizeof(struct t_twc_queued_message)
+           + message_queue->arena.size
+           + message_queue->receipts_size * sizeof(struct t_twc_message_receipt);
+}
+
+/**
+ * Return a chunk of a queued message.
+ */
+struct t_twc_message_chunk
+twc_message_queue_chunk(struct t_twc_message_queue *message_queue,
+                        struct t_twc_queued_message *message, uint32_t index)
+{
+    struct t_twc_message_chunk chunk = { 0, message->length };
+    if (message->chunk_count > 1)
+    {
+        memcpy(&chunk,
+               twc_message_queue_text(message_queue, message)
+               + TWC_MESSAGE_QUEUE_ALIGN(message->length)
+               + index * sizeof(struct t_twc_message_chunk),
+               sizeof(chunk));
+    }
+
+    return chunk;
+}
+
+/**
+ * Make room for size bytes at the end of a queue's arena, and store their
+ * offset in offset. Consumed bytes at the front are reclaimed by sliding the
+ * live bytes down, but only once they are at least as many as the live ones,
+ * so that each byte is moved a bounded number of times; otherwise the arena
+ * grows. Returns false, leaving the queued bytes as they were, if it could
+ * not grow.
+ */
+bool
+twc_message_queue_arena_reserve(struct t_twc_message_arena *arena,
+                                size_t size, size_t *offset)
+{
+    if (arena->end - arena->base + size > arena->size)
+    {
+        size_t consumed = arena->start - arena->base;
+        size_t live = arena->end - arena->start;
+        if (consumed >= live)
+        {
+            if (live > 0)
+                memmove(arena->data, arena->data + consumed, live);
+            arena->base = arena->start;
+        }
+
+        size_t used = arena->end - arena->base;
+        if (used + size > arena->size)
+        {
+            size_t new_size = arena->size ? arena->size : 1024;
+            while (used + size > new_size)
+                new_size *= 2;
+            uint8_t *data = realloc(arena->data, new_size);
+            if (!data)
+                return false;
+            arena->data = data;
+            arena->size = new_size;
+        }
+    }
+
+    *offset = arena->end;
+    arena->end += size;
+
+    return true;
+}
+
+/**
+ * Split a message into chunks no longer than TOX_MAX_MESSAGE_LENGTH and
+ * return how many there are. If chunks is not NULL, their bounds are stored
+ * there.
+ */
+uint32_t
+twc_message_queue_split(const char *message, size_t length,
+                        struct t_twc_message_chunk *chunks)
+{
+    uint32_t count = 0;
+    size_t offset = 0;
+    while (offset < length)
+    {
+        size_t chunk_length = twc_utf8_split_length(message + offset,
+                                                    length - offset,
+                                                    TOX_MAX_MESSAGE_LENGTH);
+        if (chunks)
+        {
+            chunks[count].offset = offset;
+            chunks[count].length = chunk_length;
+        }
+        ++count;
+
+        // drop the whitespace a chunk was split at
+        offset += chunk_length;
+        if (offset < length
+            && (message[offset] == ' ' || message[offset] == '\t'
+                || message[offset] == '\n'))
+            ++offset;
+    }
+
+    return count;
+}
+
+/**
+ * Drop delivered messages from the front of a queue, and reclaim their text.
+ * The memory of a queue that held a large backlog is freed once it is empty.
  */
 void
+twc_message_queue_pop_delivered(struct t_twc_profile *profile,
+                                struct t_twc_message_queue *message_queue)
+{
+    while (message_queue->messages_count > 0
+           && message_queue->first_seq < message_queue->next_unsent)
+    {
+        struct t_twc_queued_message *message
+            = &message_queue->messages[message_queue->messages_head];
+        if (message->chunks_delivered < message->chunk_count)
+            break;
+
+        message_queue->messages_head = (message_queue->messages_head + 1)
+                                       & (message_queue->messages_size - 1);
+        --(message_queue->messages_count);
+        ++(message_queue->first_seq);
+    }
+
+    struct t_twc_message_arena *arena = &message_queue->arena;
+    size_t start = message_queue->messages_count > 0
+                   ? message_queue->messages[message_queue->messages_head].offset
+                   : arena->end;
+    profile->queued_message_bytes -= start - arena->start;
+    arena->start = start;
+
+    if (message_queue->messages_count == 0)
+    {
+        if (arena->size > TWC_MESSAGE_QUEUE_KEEP_BYTES)
+        {
+            free(arena->data);
+            arena->data = NULL;
+            arena->size = 0;
+            arena->base = arena->end;
+        }
+        if (message_queue->messages_size > TWC_MESSAGE_QUEUE_KEEP_MESSAGES)
+        {
+            free(message_queue->messages);
+            message_queue->messages = NULL;
+            message_queue->messages_size = 0;
+            message_queue->messages_head = 0;
+        }
+        if (message_queue->receipts_count == 0
+            && message_queue->receipts_size > TWC_MESSAGE_QUEUE_KEEP_MESSAGES)
+        {
+            free(message_queue->receipts);
+            message_queue->receipts = NULL;
+            message_queue->receipts_size = 0;
+            message_queue->receipts_head = 0;
+        }
+    }
+}
+
+/**
+ * Return the bytes a message of length bytes and chunk_count chunks takes in
+ * a queue's arena.
+ */
+size_t
+twc_message_queue_message_size(size_t length, uint32_t chunk_count)
+{
+    if (chunk_count <= 1)
+        return length;
+
+    return TWC_MESSAGE_QUEUE_ALIGN(length)
+           + chunk_count * sizeof(struct t_twc_message_chunk);
+}
+
+/**
+ * Add a message to the end of a friend's queue. Messages too long for Tox
+ * are split into several chunks, once, here. Returns NULL for an empty
+ * message, which Tox would refuse anyway, or if memory runs out.
+ */
+struct t_twc_queued_message *
+twc_message_queue_push(struct t_twc_profile *profile, int32_t friend_number,
+                       const char *message, size_t length,
+                       enum TWC_MESSAGE_TYPE message_type, time_t time)
+{
+    struct t_twc_message_queue *message_queue
+        = twc_message_queue_get_or_create(profile, friend_number);
+    if (!message_queue || length == 0)
+        return NULL;
+
+    // grow the ring if needed
+    if (message_queue->messages_count == message_queue->messages_size)
+    {
+        size_t size = message_queue->messages_size
+                      ? message_queue->messages_size * 2 : 16;
+        struct t_twc_queued_message *messages
+            = malloc(sizeof(struct t_twc_queued_message) * size);
+        if (!messages)
+            return NULL;
+
+        size_t mask = message_queue->messages_size - 1;
+        for (size_t i = 0; i < message_queue->messages_count; ++i)
+            messages[i] = message_queue->messages[(message_queue->messages_head + i) & mask];
+
+        free(message_queue->messages);
+        message_queue->messages = messages;
+        message_queue->messages_size = size;
+        message_queue->messages_head = 0;
+    }
+
+    uint32_t chunk_count = twc_message_queue_split(message, length, NULL);
+    size_t size = twc_message_queue_message_size(length, chunk_count);
+
+    struct t_twc_queued_message *queued_message
+        = &message_queue->messages[(message_queue->messages_head
+                                    + message_queue->messages_count)
+                                   & (message_queue->messages_size - 1)];
+    if (!twc_message_queue_arena_reserve(&message_queue->arena, size,
+                                         &queued_message->offset))
+        return NULL;
+    queued_message->id = twc_message_queue_next_id++;
+    queued_message->time = time;
+    queued_message->length = length;
+    queued_message->journal_record = TWC_MESSAGE_QUEUE_NO_RECORD;
+    queued_message->chunk_count = chunk_count;
+    queued_message->chunks_sent = 0;
+    queued_message->chunks_delivered = 0;
+    queued_message->message_type = message_type;
+
+    char *text = (char *)twc_message_queue_text(message_queue, queued_message);
+    memcpy(text, message, length);
+    if (chunk_count > 1)
+    {
+        struct t_twc_message_chunk chunks[chunk_count];
+        twc_message_queue_split(message, length, chunks);
+        memcpy(text + TWC_MESSAGE_QUEUE_ALIGN(length), chunks, sizeof(chunks));
+    }
+
+    ++(message_queue->messages_count);
+    ++(profile->queued_message_count);
+    profile->queued_message_bytes += size;
+
+    return queued_message;
+}
+
+/**
+ * Drop the oldest message of a queue, delivered or not.
+ */
+void
+twc_message_queue_drop_oldest(struct t_twc_profile *profile,
+                              struct t_twc_message_queue *message_queue)
+{
+    struct t_twc_queued_message *message
+        = twc_message_queue_at(message_queue, message_queue->first_seq);
+    if (!message)
+        return;
+
+    struct t_twc_chat *chat = twc_chat_search_friend(profile,
+                                                     message_queue->friend_number,
+                                                     false);
+    if (chat)
+        twc_chat_forget_message(chat, message->id);
+    twc_journal_dequeue(profile, message_queue, message);
+    --(profile->queued_message_count);
+    ++(message_queue->dropped_count);
+
+    // let it be popped like a delivered message; receipts for it are
+    // ignored from now on
+    message->chunks_delivered = message->chunk_count;
+    if (message_queue->next_unsent == message_queue->first_seq)
+        ++(message_queue->next_unsent);
+    twc_message_queue_pop_delivered(profile, message_queue);
+}
+
+/**
+ * Return the queue of a profile whose oldest message is the oldest, or NULL
+ * if nothing is queued.
+ */
+struct t_twc_message_queue *
+twc_message_queue_oldest(struct t_twc_profile *profile)
+{
+    struct t_twc_message_queue *oldest = NULL;
+    time_t oldest_time = 0;
+    for (size_t i = 0; i < profile->message_queues_size; ++i)
+    {
+        struct t_twc_message_queue *message_queue = profile->message_queues[i];
+        if (!message_queue || message_queue->messages_count == 0)
+            continue;
+
+        time_t time = message_queue->messages[message_queue->messages_head].time;
+        if (!oldest || time < oldest_time)
+        {
+            oldest = message_queue;
+            oldest_time = time;
+        }
+    }
+
+    return oldest;
+}
+
+/**
+ * Make room for a message of size bytes in a friend's queue within the
+ * profile's limits on queued messages, dropping old messages if the
+ * overflow policy allows it. Returns TWC_RC_ERROR_TOO_LARGE if the message
+ * would not fit even in empty queues, or if there is no room either
+ * TWC_RC_DROPPED or TWC_RC_ERROR_FULL, depending on the policy.
+ */
+enum t_twc_rc
+twc_message_queue_make_room(struct t_twc_profile *profile,
+                            struct t_twc_message_queue *message_queue,
+                            size_t size)
+{
+    size_t max_messages = TWC_PROFILE_OPTION_INTEGER(profile,
+                                                     TWC_PROFILE_OPTION_QUEUE_MAX_MESSAGES);
+    size_t max_bytes = TWC_PROFILE_OPTION_INTEGER(profile,
+                                                  TWC_PROFILE_OPTION_QUEUE_MAX_BYTES);
+    size_t total_max_messages = TWC_PROFILE_OPTION_INTEGER(profile,
+                                                           TWC_PROFILE_OPTION_QUEUE_TOTAL_MAX_MESSAGES);
+    size_t total_max_bytes = TWC_PROFILE_OPTION_INTEGER(profile,
+                                                        TWC_PROFILE_OPTION_QUEUE_TOTAL_MAX_BYTES);
+    enum t_twc_message_queue_overflow overflow =
+        TWC_PROFILE_OPTION_INTEGER(profile, TWC_PROFILE_OPTION_QUEUE_OVERFLOW);
+
+    // would not fit even in an empty queue
+    if ((max_bytes && size > max_bytes)
+        || (total_max_bytes && size > total_max_bytes))
+        return TWC_RC_ERROR_TOO_LARGE;
+
+    for (;;)
+    {
+        bool friend_full =
+            (max_messages && message_queue->messages_count + 1 > max_messages)
+            || (max_bytes && twc_message_queue_bytes(message_queue) + size > max_bytes);
+        bool profile_full =
+            (total_max_messages && profile->queued_message_count + 1 > total_max_messages)
+            || (total_max_bytes && profile->queued_message_bytes + size > total_max_bytes);
+        if (!friend_full && !profile_full)
+            return TWC_RC_OK;
+
+        if (overflow == TWC_MESSAGE_QUEUE_OVERFLOW_DROP_NEWEST)
+            return TWC_RC_DROPPED;
+        if (overflow != TWC_MESSAGE_QUEUE_OVERFLOW_DROP_OLDEST)
+            return TWC_RC_ERROR_FULL;
+
+        struct t_twc_message_queue *victim = friend_full
+                                             ? message_queue
+                                             : twc_message_queue_oldest(profile);
+        if (!victim || victim->messages_count == 0)
+            return TWC_RC_ERROR_FULL;
+
+        twc_message_queue_drop_oldest(profile, victim);
+    }
+}
+
+/**
+ * Add a friend message to the message queue and tries to send it if the
+ * friend is online. The message's ID is stored in message_id. Returns
+ * TWC_RC_ERROR for an empty message, TWC_RC_DROPPED or TWC_RC_ERROR_FULL if
+ * the queue is full and the overflow policy is to drop or reject new
+ * messages, TWC_RC_ERROR_TOO_LARGE if the message exceeds the queue limits
+ * on its own, or TWC_RC_ERROR_MALLOC if it could not be queued.
+ */
+enum t_twc_rc
 twc_message_queue_add_friend_message(struct t_twc_profile *profile,
                                      int32_t friend_number,
                                      const char *message,
-                                     enum TWC_MESSAGE_TYPE message_type)
+                                     enum TWC_MESSAGE_TYPE message_type,
+                                     uint64_t *message_id)
 {
-    struct t_twc_queued_message *queued_message
-        = malloc(sizeof(struct t_twc_queued_message));
+    *message_id = twc_message_queue_next_id;
 
-    time_t rawtime = time(NULL);
-    queued_message->time = malloc(sizeof(struct tm));
-    memcpy(queued_message->time, gmtime(&rawtime), sizeof(struct tm));
+    // Tox refuses empty messages, and they would never be delivered
+    size_t length = strlen(message);
+    if (length == 0)
+        return TWC_RC_ERROR;
 
-    queued_message->message = strdup(message);
-    queued_message->message_type = message_type;
-
-    // create a queue if needed and add message
-    struct t_twc_list *message_queue
+    struct t_twc_message_queue *message_queue
         = twc_message_queue_get_or_create(profile, friend_number);
-    twc_list_item_new_data_add(message_queue, queued_message);
+    if (!message_queue)
+        return TWC_RC_ERROR_MALLOC;
+
+    enum t_twc_rc rc =
+        twc_message_queue_make_room(profile, message_queue,
+                                    twc_message_queue_message_size(length,
+                                                                   twc_message_queue_split(message, length, NULL)));
+    if (rc != TWC_RC_OK)
+    {
+        ++(message_queue->dropped_count);
+        return rc;
+    }
 
-    // flush if friend is online
+    struct t_twc_queued_message *queued_message =
+        twc_message_queue_push(profile, friend_number,
+                               message, length, message_type,
+                               time(NULL));
+    if (!queued_message)
+        return TWC_RC_ERROR_MALLOC;
+
+    twc_journal_enqueue(profile, message_queue, queued_message);
+
+    // send if friend is online, unless the queue is already being sent or
+    // waits for a retry
     if (profile->tox
+        && !message_queue->sending_item.list
+        && !twc_timer_wheel_is_scheduled(&message_queue->retry)
         && (tox_friend_get_connection_status(profile->tox, friend_number, NULL) != TOX_CONNECTION_NONE))
-        twc_message_queue_flush_friend(profile, friend_number);
+        twc_message_queue_send(profile, message_queue);
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Queue a message read back from the journal. It is sent when the friend
+ * comes online. Returns TWC_RC_ERROR_MALLOC if it could not be queued.
+ */
+enum t_twc_rc
+twc_message_queue_restore_friend_message(struct t_twc_profile *profile,
+                                         int32_t friend_number,
+                                         const char *message, size_t length,
+                                         enum TWC_MESSAGE_TYPE message_type,
+                                         time_t time)
+{
+    if (!twc_message_queue_push(profile, friend_number, message, length,
+                                message_type, time))
+        return TWC_RC_ERROR_MALLOC;
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Make sure there is room for one more receipt, growing the receipt ring if
+ * it is full. Returns false, keeping the old ring, if it could not grow.
+ */
+bool
+twc_message_queue_reserve_receipt(struct t_twc_message_queue *message_queue)
+{
+    if (message_queue->receipts_count < message_queue->receipts_size)
+        return true;
+
+    size_t size = message_queue->receipts_size
+                  ? message_queue->receipts_size * 2 : 16;
+    struct t_twc_message_receipt *receipts
+        = malloc(sizeof(struct t_twc_message_receipt) * size);
+    if (!receipts)
+        return false;
+
+    size_t mask = message_queue->receipts_size - 1;
+    for (size_t i = 0; i < message_queue->receipts_count; ++i)
+        receipts[i] = message_queue->receipts[(message_queue->receipts_head + i) & mask];
+
+    free(message_queue->receipts);
+    message_queue->receipts = receipts;
+    message_queue->receipts_size = size;
+    message_queue->receipts_head = 0;
+
+    return true;
 }
 
 /**
- * Try sending queued messages for a friend.
+ * Remember that a chunk of message seq, or message_count whole messages from
+ * seq on, was sent with a message ID. There must be room for it (see
+ * twc_message_queue_reserve_receipt).
  */
 void
-twc_message_queue_flush_friend(struct t_twc_profile *profile,
-                               int32_t friend_number)
+twc_message_queue_add_receipt(struct t_twc_profile *profile,
+                              struct t_twc_message_queue *message_queue,
+                              uint32_t message_id, uint64_t seq,
+                              uint32_t message_count)
 {
-    struct t_twc_list *message_queue
-        = twc_message_queue_get_or_create(profile, friend_number);
+    size_t mask = message_queue->receipts_size - 1;
+    struct t_twc_message_receipt *receipt
+        = &message_queue->receipts[(message_queue->receipts_head
+                                    + message_queue->receipts_count) & mask];
+    receipt->message_id = message_id;
+    receipt->message_count = message_count;
+    receipt->seq = seq;
+    ++(message_queue->receipts_count);
+    ++(profile->pending_receipt_count);
+}
+
+/**
+ * Finish a message that has been delivered in full: mark its line as sent
+ * and journal it.
+ */
+void
+twc_message_queue_complete_message(struct t_twc_profile *profile,
+                                   struct t_twc_message_queue *message_queue,
+                                   struct t_twc_queued_message *message)
+{
+    struct t_twc_chat *chat = twc_chat_search_friend(profile,
+                                                     message_queue->friend_number,
+                                                     false);
+    if (chat)
+        twc_chat_mark_message_sent(chat, message->id);
+    twc_journal_dequeue(profile, message_queue, message);
+
+    --(profile->queued_message_count);
+}
 
-    size_t index;
-    struct t_twc_list_item *item;
-    twc_list_foreach(message_queue, index, item)
+/**
+ * Join the unsent one-chunk messages at the front of a queue that have the
+ * same type into buffer, one per line, each prefixed with the time it was
+ * queued, up to TOX_MAX_MESSAGE_LENGTH bytes. Returns the number of messages
+ * joined; the buffer is only worth sending if it is more than one.
+ */
+uint32_t
+twc_message_queue_coalesce(struct t_twc_message_queue *message_queue,
+                           uint8_t *buffer, size_t *length)
+{
+    uint64_t seq = message_queue->next_unsent;
+    struct t_twc_queued_message *first = twc_message_queue_at(message_queue,
+                                                              seq);
+    uint32_t count = 0;
+    size_t used = 0;
+
+    struct t_twc_queued_message *message;
+    while ((message = twc_message_queue_at(message_queue, seq + count))
+           && message->chunk_count == 1 && message->chunks_sent == 0
+           && message->message_type == first->message_type)
     {
-        struct t_twc_queued_message *queued_message = item->queued_message;
+        char prefix[32];
+        size_t prefix_length = strftime(prefix, sizeof(prefix), "[%H:%M:%S] ",
+                                        localtime(&message->time));
+        if (used + (count > 0) + prefix_length + message->length
+            > TOX_MAX_MESSAGE_LENGTH)
+            break;
+
+        if (count > 0)
+            buffer[used++] = '\n';
+        memcpy(buffer + used, prefix, prefix_length);
+        used += prefix_length;
+        memcpy(buffer + used, twc_message_queue_text(message_queue, message),
+               message->length);
+        used += message->length;
+        ++count;
+    }
+
+    *length = used;
+    return count;
+}
+
+/**
+ * Send queued chunks to a friend while the queue's deficit and the budget
+ * allow, taking what is sent from both. Chunks already delivered are
+ * skipped, so this also retransmits after twc_message_queue_reset_friend.
+ */
+enum t_twc_message_queue_status
+twc_message_queue_send_chunks(struct t_twc_profile *profile,
+                              struct t_twc_message_queue *message_queue,
+                              size_t *budget)
+{
+    int32_t friend_number = message_queue->friend_number;
+    enum t_twc_message_queue_status status = TWC_MESSAGE_QUEUE_DRAINED;
+    bool coalesce = TWC_PROFILE_OPTION_BOOLEAN(profile,
+                                               TWC_PROFILE_OPTION_COALESCE_MESSAGES);
+    uint8_t buffer[TOX_MAX_MESSAGE_LENGTH];
+
+    struct t_twc_queued_message *queued_message;
+    while ((queued_message = twc_message_queue_at(message_queue,
+                                                  message_queue->next_unsent)))
+    {
+        // message was sent, wait for its receipts
+        if (queued_message->chunks_sent == queued_message->chunk_count)
+        {
+            ++(message_queue->next_unsent);
+            continue;
+        }
+
+        struct t_twc_message_chunk chunk =
+            twc_message_queue_chunk(message_queue, queued_message,
+                                    queued_message->chunks_sent);
+        const uint8_t *data = (const uint8_t *)twc_message_queue_text(message_queue,
+                                                                      queued_message)
+                              + chunk.offset;
+        size_t length = chunk.length;
+
+        // send a backlog of short messages as one
+        uint32_t message_count = 1;
+        if (coalesce && queued_message->chunk_count == 1)
+        {
+            size_t coalesced_length;
+            uint32_t coalesced = twc_message_queue_coalesce(message_queue,
+                                                            buffer,
+                                                            &coalesced_length);
+            if (coalesced > 1)
+            {
+                data = buffer;
+                length = coalesced_length;
+                message_count = coalesced;
+            }
+        }
+
+        if (length > message_queue->deficit || length > *budget)
+        {
+            status = TWC_MESSAGE_QUEUE_READY;
+            break;
+        }
+
+        // without room to track its receipt, leave the chunk unsent and
+        // retry later
+        if (!twc_message_queue_reserve_receipt(message_queue))
+        {
+            status = TWC_MESSAGE_QUEUE_STALLED;
+            break;
+        }
 
-        // TODO: store and deal with message IDs
         TOX_ERR_FRIEND_SEND_MESSAGE err;
-        (void)tox_friend_send_message(profile->tox,
-                                      friend_number,
-                                      queued_message->message_type == TWC_MESSAGE_TYPE_MESSAGE?
-                                        TOX_MESSAGE_TYPE_NORMAL:
-                                        TOX_MESSAGE_TYPE_ACTION,
-                                      (uint8_t *)queued_message->message,
-                                      strlen(queued_message->message),
-                                      &err);
+        uint32_t message_id =
+            tox_friend_send_message(profile->tox,
+                                    friend_number,
+                                    queued_message->message_type == TWC_MESSAGE_TYPE_MESSAGE?
+                                      TOX_MESSAGE_TYPE_NORMAL:
+                                      TOX_MESSAGE_TYPE_ACTION,
+                                    data, length, &err);
 
+        // a full send queue clears up as Tox iterates
         if (err != TOX_ERR_FRIEND_SEND_MESSAGE_OK)
         {
-            // break if message send failed
+            status = err == TOX_ERR_FRIEND_SEND_MESSAGE_SENDQ
+                     ? TWC_MESSAGE_QUEUE_BLOCKED : TWC_MESSAGE_QUEUE_STALLED;
             break;
         }
-        else
+
+        twc_message_queue_add_receipt(profile, message_queue, message_id,
+                                      message_queue->next_unsent,
+                                      message_count);
+        for (uint32_t i = 0; i < message_count; ++i)
+            ++(twc_message_queue_at(message_queue,
+                                    message_queue->next_unsent + i)->chunks_sent);
+        message_queue->deficit -= length;
+        *budget -= length;
+    }
+
+    twc_message_queue_pop_delivered(profile, message_queue);
+
+    // an idle queue does not save up its share
+    if (status == TWC_MESSAGE_QUEUE_DRAINED
+        || status == TWC_MESSAGE_QUEUE_STALLED)
+        message_queue->deficit = 0;
+
+    return status;
+}
+
+/**
+ * Handle a queue that twc_message_queue_send_chunks drained or could not
+ * send to. If it still has messages to send and its friend is online, it is retried
+ * later, waiting twice as long after every failed attempt; otherwise it waits
+ * for the friend (or the profile) to come online.
+ */
+void
+twc_message_queue_stalled(struct t_twc_profile *profile,
+                          struct t_twc_message_queue *message_queue)
+{
+    struct t_twc_friend *friend = twc_roster_get(profile,
+                                                 message_queue->friend_number);
+
+    if (!twc_message_queue_at(message_queue, message_queue->next_unsent)
+        || !friend || friend->connection == TOX_CONNECTION_NONE)
+    {
+        twc_timer_wheel_cancel(&profile->message_retry_wheel,
+                               &message_queue->retry);
+        message_queue->retry_attempts = 0;
+        return;
+    }
+
+    long delay = TWC_MESSAGE_QUEUE_RETRY_MIN;
+    for (unsigned int i = 0;
+         i < message_queue->retry_attempts && delay < TWC_MESSAGE_QUEUE_RETRY_MAX;
+         ++i)
+        delay *= 2;
+    if (delay > TWC_MESSAGE_QUEUE_RETRY_MAX)
+        delay = TWC_MESSAGE_QUEUE_RETRY_MAX;
+
+    ++(message_queue->retry_attempts);
+    twc_timer_wheel_schedule(&profile->message_retry_wheel,
+                             &message_queue->retry, delay);
+}
+
+/**
+ * Send one quantum of a queue that is not being sent yet, outside the
+ * per-tick budget, so new messages go out right away. The sending timer
+ * takes care of the rest, if any.
+ */
+void
+twc_message_queue_send(struct t_twc_profile *profile,
+                       struct t_twc_message_queue *message_queue)
+{
+    size_t budget = TWC_MESSAGE_QUEUE_QUANTUM;
+    message_queue->deficit += TWC_MESSAGE_QUEUE_QUANTUM;
+
+    switch (twc_message_queue_send_chunks(profile, message_queue, &budget))
+    {
+        case TWC_MESSAGE_QUEUE_READY:
+        case TWC_MESSAGE_QUEUE_BLOCKED:
+            twc_timer_wheel_cancel(&profile->message_retry_wheel,
+                                   &message_queue->retry);
+            message_queue->retry_attempts = 0;
+
+            twc_list_add(profile->sending_message_queues,
+                         &message_queue->sending_item);
+            twc_message_queue_schedule(profile);
+            break;
+        default:
+            twc_message_queue_stalled(profile, message_queue);
+            break;
+    }
+}
+
+/**
+ * Callback for a profile's message_retry_wheel: try sending a stalled queue
+ * again.
+ */
+void
+twc_message_queue_retry_callback(struct t_twc_timer_wheel *wheel,
+                                 struct t_twc_timer_wheel_entry *entry)
+{
+    struct t_twc_profile *profile = wheel->data;
+    struct t_twc_message_queue *message_queue =
+        (struct t_twc_message_queue *)((char *)entry
+            - offsetof(struct t_twc_message_queue, retry));
+
+    twc_worker_lock(profile);
+    if (profile->tox && !message_queue->sending_item.list)
+        twc_message_queue_send(profile, message_queue);
+    twc_worker_unlock(profile);
+}
+
+/**
+ * Callback for the timer that keeps sending backlogs. Queues take turns in
+ * deficit round-robin order: each turn adds a quantum to a queue's deficit,
+ * and it sends chunks until the next one would not fit, so friends share the
+ * per-tick budget fairly whatever the size of their backlogs. The queue that
+ * runs out of budget is first in line on the next tick.
+ */
+int
+twc_message_queue_timer_callback(void *data, int remaining)
+{
+    struct t_twc_profile *profile = data;
+    profile->message_queue_timer = NULL;
+
+    twc_worker_lock(profile);
+    if (profile->tox)
+    {
+        size_t budget = weechat_config_integer(twc_config_send_budget);
+
+        // queues with a full Tox send queue sit out the rest of the tick
+        struct t_twc_list blocked = { 0, NULL, NULL };
+
+        struct t_twc_message_queue *message_queue;
+        while ((message_queue = twc_list_data(profile->sending_message_queues->head,
+                                              struct t_twc_message_queue,
+                                              sending_item)))
         {
-            // message was sent, free it
-            twc_message_queue_free_message(queued_message);
-            item->queued_message = NULL;
+            size_t budget_before = budget;
+            message_queue->deficit += TWC_MESSAGE_QUEUE_QUANTUM;
+
+            enum t_twc_message_queue_status status =
+                twc_message_queue_send_chunks(profile, message_queue, &budget);
+
+            // its next chunk does not fit in what is left; it keeps its turn
+            if (status == TWC_MESSAGE_QUEUE_READY && budget == budget_before)
+            {
+                message_queue->deficit -= TWC_MESSAGE_QUEUE_QUANTUM;
+                break;
+            }
+
+            twc_list_remove(&message_queue->sending_item);
+            if (status == TWC_MESSAGE_QUEUE_READY)
+                twc_list_add(profile->sending_message_queues,
+                             &message_queue->sending_item);
+            else if (status == TWC_MESSAGE_QUEUE_BLOCKED)
+                twc_list_add(&blocked, &message_queue->sending_item);
+            else
+                twc_message_queue_stalled(profile, message_queue);
+        }
+
+        while ((message_queue = twc_list_data(blocked.head,
+                                              struct t_twc_message_queue,
+                                              sending_item)))
+        {
+            twc_list_remove(&message_queue->sending_item);
+            twc_list_add(profile->sending_message_queues,
+                         &message_queue->sending_item);
         }
     }
+    twc_message_queue_schedule(profile);
+    twc_worker_unlock(profile);
 
-    // remove any now-empty items
-    while (message_queue->head && !(message_queue->head->queued_message))
-        twc_list_remove(message_queue->head);
+    return WEECHAT_RC_OK;
 }
 
 /**
- * Free a queued message.
+ * Make sure the sending timer runs while queues are waiting to send. It
+ * fires after one iteration interval, to give Tox a chance to drain its own
+ * queues.
+ *
+ * Must be called with the worker lock held, as the worker thread updates the
+ * interval.
  */
 void
-twc_message_queue_free_message(struct t_twc_queued_message *message)
+twc_message_queue_schedule(struct t_twc_profile *profile)
 {
-    free(message->time);
-    free(message->message);
-    free(message);
+    if (profile->message_queue_timer
+        || profile->sending_message_queues->count == 0)
+        return;
+
+    long interval = profile->schedule.interval;
+    profile->message_queue_timer =
+        weechat_hook_timer(interval > 0 ? interval : 1, 0, 1,
+                           twc_message_queue_timer_callback, profile);
 }
 
+/**
+ * Try sending queued messages for a friend, e.g. when a connection comes up.
+ * Sends one window right away and leaves the rest, if any, to the sending
+ * timer; a pending retry is brought forward.
+ */
 void
-twc_message_queue_free_map_callback(void *data, struct t_hashtable *hashtable,
-                                    const void *key, const void *value)
+twc_message_queue_flush_friend(struct t_twc_profile *profile,
+                               int32_t friend_number)
 {
-    struct t_twc_list *message_queue = ((struct t_twc_list *)value);
+    struct t_twc_message_queue *message_queue
+        = twc_message_queue_get(profile, friend_number);
 
-    struct t_twc_queued_message *message;
-    while ((message = twc_list_pop(message_queue)))
-        twc_message_queue_free_message(message);
+    // nothing queued, or already being sent (keep the order of queues)
+    if (!message_queue || message_queue->sending_item.list)
+        return;
+
+    // a connection came up, so start backing off over
+    twc_timer_wheel_cancel(&profile->message_retry_wheel,
+                           &message_queue->retry);
+    message_queue->retry_attempts = 0;
+
+    twc_message_queue_send(profile, message_queue);
+}
+
+/**
+ * Try sending queued messages for all online friends of a profile.
+ */
+void
+twc_message_queue_flush_profile(struct t_twc_profile *profile)
+{
+    for (size_t i = 0; i < profile->message_queues_size; ++i)
+    {
+        struct t_twc_message_queue *message_queue = profile->message_queues[i];
+        struct t_twc_friend *friend = twc_roster_get(profile, i);
+
+        if (message_queue && friend
+            && friend->connection != TOX_CONNECTION_NONE
+            && message_queue->next_unsent < message_queue->first_seq
+                                            + message_queue->messages_count)
+            twc_message_queue_flush_friend(profile, i);
+    }
+}
+
+/**
+ * Handle a read receipt from a friend. Receipts normally arrive in the order
+ * messages were sent, so the search rarely goes past the oldest entry.
+ */
+void
+twc_message_queue_read_receipt(struct t_twc_profile *profile,
+                               int32_t friend_number, uint32_t message_id)
+{
+    struct t_twc_message_queue *message_queue
+        = twc_message_queue_get(profile, friend_number);
+    if (!message_queue || message_queue->receipts_count == 0)
+        return;
+
+    size_t mask = message_queue->receipts_size - 1;
+    struct t_twc_message_receipt *receipt = NULL;
+    for (size_t i = 0; i < message_queue->receipts_count; ++i)
+    {
+        struct t_twc_message_receipt *candidate
+            = &message_queue->receipts[(message_queue->receipts_head + i) & mask];
+        if (candidate->seq != TWC_MESSAGE_QUEUE_NO_SEQ
+            && candidate->message_id == message_id)
+        {
+            receipt = candidate;
+            break;
+        }
+    }
+    if (!receipt)
+        return;
+
+    uint64_t seq = receipt->seq;
+    uint32_t message_count = receipt->message_count;
+    receipt->seq = TWC_MESSAGE_QUEUE_NO_SEQ;
+
+    // drop acknowledged receipts from the front of the ring
+    while (message_queue->receipts_count > 0
+           && message_queue->receipts[message_queue->receipts_head].seq
+              == TWC_MESSAGE_QUEUE_NO_SEQ)
+    {
+        message_queue->receipts_head = (message_queue->receipts_head + 1) & mask;
+        --(message_queue->receipts_count);
+        --(profile->pending_receipt_count);
+    }
+
+    bool completed = false;
+    for (uint32_t i = 0; i < message_count; ++i)
+    {
+        struct t_twc_queued_message *message
+            = twc_message_queue_at(message_queue, seq + i);
+        if (!message || message->chunks_delivered == message->chunk_count)
+            continue;
+
+        if (++(message->chunks_delivered) == message->chunk_count)
+        {
+            twc_message_queue_complete_message(profile, message_queue, message);
+            completed = true;
+        }
+    }
+
+    if (completed)
+        twc_message_queue_pop_delivered(profile, message_queue);
+}
+
+/**
+ * Forget the receipts a friend's queue is waiting for, and queue every
+ * undelivered chunk to be sent again. Tox does not deliver receipts for
+ * messages sent before a friend went offline.
+ */
+void
+twc_message_queue_reset_friend(struct t_twc_profile *profile,
+                               int32_t friend_number)
+{
+    struct t_twc_message_queue *message_queue
+        = twc_message_queue_get(profile, friend_number);
+    if (!message_queue)
+        return;
+
+    profile->pending_receipt_count -= message_queue->receipts_count;
+    message_queue->receipts_head = 0;
+    message_queue->receipts_count = 0;
+    twc_list_remove(&message_queue->sending_item);
+    twc_timer_wheel_cancel(&profile->message_retry_wheel,
+                           &message_queue->retry);
+    message_queue->retry_attempts = 0;
+    message_queue->deficit = 0;
+
+    for (size_t i = 0; i < message_queue->messages_count; ++i)
+    {
+        struct t_twc_queued_message *message
+            = twc_message_queue_at(message_queue, message_queue->first_seq + i);
+        message->chunks_sent = message->chunks_delivered;
+    }
+    message_queue->next_unsent = message_queue->first_seq;
+}
 
-    free(message_queue);
+/**
+ * Return true if a profile is sending messages: queues wait for their turn or
+ * a retry, or sent chunks wait for their read receipts.
+ */
+bool
+twc_message_queue_is_sending(struct t_twc_profile *profile)
+{
+    return profile->sending_message_queues->count > 0
+           || profile->message_retry_wheel.count > 0
+           || profile->pending_receipt_count > 0;
+}
+
+/**
+ * Stop sending backlogs, e.g. when a profile's Tox instance goes away.
+ */
+void
+twc_message_queue_stop_sending(struct t_twc_profile *profile)
+{
+    if (profile->message_queue_timer)
+        weechat_unhook(profile->message_queue_timer);
+    profile->message_queue_timer = NULL;
+
+    while (twc_list_pop(profile->sending_message_queues))
+        ;
+    twc_timer_wheel_clear(&profile->message_retry_wheel);
+}
+
+/**
+ * Reset the queues of all friends of a profile, e.g. when its Tox instance
+ * goes away.
+ */
+void
+twc_message_queue_reset_profile(struct t_twc_profile *profile)
+{
+    twc_message_queue_stop_sending(profile);
+
+    for (size_t i = 0; i < profile->message_queues_size; ++i)
+        twc_message_queue_reset_friend(profile, i);
 }
 
 /**
@@ -154,8 +1128,25 @@ twc_message_queue_free_map_callback(void *data, struct t_hashtable *hashtable,
 void
 twc_message_queue_free_profile(struct t_twc_profile *profile)
 {
-    weechat_hashtable_map(profile->message_queues,
-                          twc_message_queue_free_map_callback, NULL);
-    weechat_hashtable_free(profile->message_queues);
+    twc_message_queue_stop_sending(profile);
+    free(profile->sending_message_queues);
+
+    for (size_t i = 0; i < profile->message_queues_size; ++i)
+    {
+        struct t_twc_message_queue *message_queue = profile->message_queues[i];
+        if (!message_queue)
+            continue;
+
+        free(message_queue->messages);
+        free(message_queue->arena.data);
+        free(message_queue->receipts);
+        free(message_queue);
+    }
+    free(profile->message_queues);
+    profile->message_queues = NULL;
+    profile->message_queues_size = 0;
+    profile->queued_message_count = 0;
+    profile->queued_message_bytes = 0;
+    profile->pending_receipt_count = 0;
 }
 
@@ -20,34 +20,234 @@
 #ifndef TOX_WEECHAT_MESSAGE_QUEUE_H
 #define TOX_WEECHAT_MESSAGE_QUEUE_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <time.h>
 
 #include <tox/tox.h>
 
+#include "twc.h"
+#include "twc-list.h"
 #include "twc-chat.h"
+#include "twc-timer-wheel.h"
 
 struct t_twc_profile;
-struct t_twc_list_item;
 
+/**
+ * Bytes a queue may send per turn of the sending timer's round-robin. Every
+ * chunk fits in one quantum, so a queue sends at least one per turn.
+ */
+#define TWC_MESSAGE_QUEUE_QUANTUM TOX_MAX_MESSAGE_LENGTH
+
+/**
+ * Delays in milliseconds before retrying a queue that stalled while its
+ * friend was online. The delay doubles with every failed attempt, up to
+ * TWC_MESSAGE_QUEUE_RETRY_MAX.
+ */
+#define TWC_MESSAGE_QUEUE_RETRY_MIN 1000
+#define TWC_MESSAGE_QUEUE_RETRY_MAX 300000
+#define TWC_MESSAGE_QUEUE_RETRY_TICK 250
+
+/**
+ * A queue emptied of a backlog frees its memory if it holds more than this
+ * much arena or ring space.
+ */
+#define TWC_MESSAGE_QUEUE_KEEP_BYTES 65536
+#define TWC_MESSAGE_QUEUE_KEEP_MESSAGES 256
+
+/**
+ * What to do with a new message when a queue or profile holds as many
+ * queued messages or bytes as allowed (the queue_overflow profile option).
+ */
+enum t_twc_message_queue_overflow
+{
+    TWC_MESSAGE_QUEUE_OVERFLOW_DROP_OLDEST = 0,
+    TWC_MESSAGE_QUEUE_OVERFLOW_DROP_NEWEST,
+    TWC_MESSAGE_QUEUE_OVERFLOW_REJECT,
+};
+
+/**
+ * Why twc_message_queue_send_chunks stopped: nothing left to send, the next
+ * chunk does not fit in the deficit or budget, Tox's send queue is full, or
+ * sending failed otherwise (e.g. the friend is not connected).
+ */
+enum t_twc_message_queue_status
+{
+    TWC_MESSAGE_QUEUE_DRAINED,
+    TWC_MESSAGE_QUEUE_READY,
+    TWC_MESSAGE_QUEUE_BLOCKED,
+    TWC_MESSAGE_QUEUE_STALLED,
+};
+
+/**
+ * A part of a queued message that fits in one Tox message, relative to the
+ * start of the message text.
+ */
+struct t_twc_message_chunk
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+/**
+ * A message to a friend. It stays queued until every chunk of it has been
+ * acknowledged with a read receipt; receipts arrive in the order chunks were
+ * sent, so the delivered chunks are always the first ones.
+ *
+ * The text lives in its queue's arena at offset. Messages of more than one
+ * chunk are followed there by their chunk table (4-byte aligned).
+ *
+ * journal_record is the number of its enqueue record in the profile's
+ * journal, or TWC_MESSAGE_QUEUE_NO_RECORD if it is not in the journal.
+ */
 struct t_twc_queued_message
 {
-    struct tm *time;
-    char *message;
+    uint64_t id;
+    time_t time;
+    size_t offset;
+    uint32_t length;
+    uint32_t journal_record;
+
+    uint32_t chunk_count;
+    uint32_t chunks_sent;
+    uint32_t chunks_delivered;
     enum TWC_MESSAGE_TYPE message_type;
 };
 
-void
+#define TWC_MESSAGE_QUEUE_NO_RECORD UINT32_MAX
+
+/**
+ * A chunk sent to Tox and waiting for its read receipt, identified by the
+ * sequence number of its message. When coalescing, one Tox message carries
+ * message_count whole messages from seq on. Acknowledged entries have seq
+ * set to TWC_MESSAGE_QUEUE_NO_SEQ.
+ */
+struct t_twc_message_receipt
+{
+    uint32_t message_id;
+    uint32_t message_count;
+    uint64_t seq;
+};
+
+#define TWC_MESSAGE_QUEUE_NO_SEQ UINT64_MAX
+
+/**
+ * Growable byte buffer holding message text. Offsets are logical: they keep
+ * counting up as data is consumed from the front, and data[0] is at offset
+ * base.
+ */
+struct t_twc_message_arena
+{
+    uint8_t *data;
+    size_t size;
+    size_t base;
+    size_t start;
+    size_t end;
+};
+
+/**
+ * The messages queued for a friend, in a ring of messages_size (a power of
+ * two) entries starting at messages_head. Messages are numbered by sequence,
+ * first_seq being the oldest. Messages before next_unsent have been sent in
+ * full; receipts holds their chunks that have not been acknowledged yet,
+ * oldest first, in a ring like the messages. While the queue has messages
+ * left to send to an online friend, it is in its profile's
+ * sending_message_queues list, with deficit bytes of sending saved up from
+ * its turns; if sending failed for another reason than a
+ * full Tox send queue, it waits on the profile's message_retry_wheel
+ * instead.
+ */
+struct t_twc_message_queue
+{
+    int32_t friend_number;
+
+    struct t_twc_queued_message *messages;
+    size_t messages_size;
+    size_t messages_head;
+    size_t messages_count;
+    uint64_t first_seq;
+    uint64_t next_unsent;
+
+    struct t_twc_message_arena arena;
+
+    struct t_twc_message_receipt *receipts;
+    size_t receipts_size;
+    size_t receipts_head;
+    size_t receipts_count;
+
+    struct t_twc_list_item sending_item;
+    size_t deficit;
+    struct t_twc_timer_wheel_entry retry;
+    unsigned int retry_attempts;
+
+    // messages dropped because of queue limits
+    size_t dropped_count;
+};
+
+struct t_twc_message_queue *
+twc_message_queue_get(struct t_twc_profile *profile, int32_t friend_number);
+
+struct t_twc_queued_message *
+twc_message_queue_at(struct t_twc_message_queue *message_queue, uint64_t seq);
+
+const char *
+twc_message_queue_text(struct t_twc_message_queue *message_queue,
+                       struct t_twc_queued_message *message);
+
+size_t
+twc_message_queue_bytes(struct t_twc_message_queue *message_queue);
+
+size_t
+twc_message_queue_memory(struct t_twc_message_queue *message_queue);
+
+enum t_twc_rc
 twc_message_queue_add_friend_message(struct t_twc_profile *profile,
                                      int32_t friend_number,
                                      const char *message,
-                                     enum TWC_MESSAGE_TYPE message_type);
+                                     enum TWC_MESSAGE_TYPE message_type,
+                                     uint64_t *message_id);
+
+enum t_twc_rc
+twc_message_queue_restore_friend_message(struct t_twc_profile *profile,
+                                         int32_t friend_number,
+                                         const char *message, size_t length,
+                                         enum TWC_MESSAGE_TYPE message_type,
+                                         time_t time);
+
+void
+twc_message_queue_send(struct t_twc_profile *profile,
+                       struct t_twc_message_queue *message_queue);
 
 void
 twc_message_queue_flush_friend(struct t_twc_profile *profile,
                                int32_t friend_number);
 
 void
-twc_message_queue_free_message(struct t_twc_queued_message *message);
+twc_message_queue_flush_profile(struct t_twc_profile *profile);
+
+void
+twc_message_queue_read_receipt(struct t_twc_profile *profile,
+                               int32_t friend_number, uint32_t message_id);
+
+void
+twc_message_queue_retry_callback(struct t_twc_timer_wheel *wheel,
+                                 struct t_twc_timer_wheel_entry *entry);
+
+void
+twc_message_queue_schedule(struct t_twc_profile *profile);
+
+bool
+twc_message_queue_is_sending(struct t_twc_profile *profile);
+
+void
+twc_message_queue_stop_sending(struct t_twc_profile *profile);
+
+void
+twc_message_queue_reset_friend(struct t_twc_profile *profile,
+                               int32_t friend_number);
+
+void
+twc_message_queue_reset_profile(struct t_twc_profile *profile);
 
 void
 twc_message_queue_free_profile(struct t_twc_profile *profile);
@@ -30,17 +30,28 @@
 #include "twc-list.h"
 #include "twc-bootstrap.h"
 #include "twc-config.h"
+#include "twc-completion.h"
 #include "twc-friend-request.h"
 #include "twc-group-invite.h"
+#include "twc-gui.h"
+#include "twc-journal.h"
 #include "twc-message-queue.h"
 #include "twc-chat.h"
+#include "twc-roster.h"
+#include "twc-save.h"
+#include "twc-scheduler.h"
 #include "twc-tox-callbacks.h"
 #include "twc-utils.h"
+#include "twc-worker.h"
 
 #include "twc-profile.h"
 
+// iterations without activity before an idle profile starts backing off
+#define TWC_PROFILE_IDLE_ITERATIONS 20
+
 struct t_twc_list *twc_profiles = NULL;
 struct t_config_option *twc_config_profile_default[TWC_PROFILE_NUM_OPTIONS];
+struct t_hashtable *twc_profile_buffers = NULL;
 
 /**
  * Get a profile's expanded data path, replacing:
@@ -62,62 +73,14 @@ twc_profile_expanded_data_path(struct t_twc_profile *profile)
 }
 
 /**
- * Save a profile's Tox data to disk.
- *
- * Returns 0 on success, -1 on failure.
+ * Save a profile's Tox data to disk, in the background (see twc_save_start).
  *
- * TODO: support encrypted save files
+ * Returns 0 if the save was started, -1 on failure.
  */
 int
 twc_profile_save_data_file(struct t_twc_profile *profile)
 {
-  if (!(profile->tox))
-    return -1;
-
-  char *full_path = twc_profile_expanded_data_path(profile);
-
-  // create containing folder if it doesn't exist
-  char *rightmost_slash = strrchr(full_path, '/');
-  char *dir_path = weechat_strndup(full_path, rightmost_slash - full_path);
-  weechat_mkdir_parents(dir_path, 0755);
-  free(dir_path);
-
-  // save Tox data to a buffer
-  size_t size = tox_get_savedata_size(profile->tox);
-  uint8_t data[size];
-  uint8_t enc_data[size + TOX_PASS_ENCRYPTION_EXTRA_LENGTH];
-  uint8_t *d = data;
-  tox_get_savedata(profile->tox, data);
-
-  char *pw = weechat_config_string(profile->options[TWC_PROFILE_OPTION_PASSPHRASE]);
-
-  if (pw)
-    pw = weechat_string_eval_expression(pw, NULL, NULL, NULL);
-
-  if (pw)
-    {
-      if (!tox_pass_encrypt(data, size, (uint8_t *)pw, strlen(pw), enc_data, NULL))
-        {
-          free(pw);
-          weechat_printf(profile->buffer, "error encrypting data");
-          return -1;
-        }
-      free(pw);
-      d = enc_data;
-      size += TOX_PASS_ENCRYPTION_EXTRA_LENGTH;
-    }
-
-  // save buffer to a file
-  FILE *file = fopen(full_path, "w");
-  if (file)
-    {
-      size_t saved_size = fwrite(d, 1, size, file);
-      fclose(file);
-
-      return saved_size == size;
-    }
-
-  return -1;
+  return twc_save_start(profile) == TWC_RC_OK ? 0 : -1;
 }
 
 /**
@@ -129,6 +92,7 @@ twc_profile_buffer_close_callback(void *data,
 {
   struct t_twc_profile *profile = data;
 
+  weechat_hashtable_remove(twc_profile_buffers, profile->buffer);
   profile->buffer = NULL;
   twc_profile_unload(profile);
 
@@ -136,12 +100,16 @@ twc_profile_buffer_close_callback(void *data,
 }
 
 /**
- * Initialize the Tox profiles list.
+ * Initialize the Tox profiles list and the buffer to profile index.
  */
 void
 twc_profile_init()
 {
   twc_profiles = twc_list_new();
+  twc_profile_buffers = weechat_hashtable_new(32,
+                                              WEECHAT_HASHTABLE_POINTER,
+                                              WEECHAT_HASHTABLE_POINTER,
+                                              NULL, NULL);
 }
 
 /**
@@ -154,21 +122,49 @@ twc_profile_new(const char *name)
   profile->name = strdup(name);
 
   // add to profile list
-  twc_list_item_new_data_add(twc_profiles, profile);
+  twc_list_add(twc_profiles, &profile->list_item);
 
   // set up internal vars
   profile->tox = NULL;
   profile->buffer = NULL;
-  profile->tox_do_timer = NULL;
+  memset(&profile->schedule, 0, sizeof(profile->schedule));
+  profile->schedule.heap_index = TWC_SCHEDULER_NOT_QUEUED;
+  profile->worker = NULL;
+  profile->iterate_mode = TWC_ITERATE_MODE_LATENCY;
+  profile->self_connection = TOX_CONNECTION_NONE;
+  profile->connection_history_count = 0;
   profile->tox_online = false;
 
+  profile->roster = twc_roster_new();
+  profile->completion_names = profile->completion_ids = NULL;
   profile->chats = twc_list_new();
+  profile->dirty_chats = NULL;
+  profile->bar_item_buffer_plugin = NULL;
+  profile->self_name = NULL;
+  profile->self_status = TOX_USER_STATUS_NONE;
+  profile->chat_refresh_timer = NULL;
+  profile->friend_chats = weechat_hashtable_new(32,
+                                                WEECHAT_HASHTABLE_INTEGER,
+                                                WEECHAT_HASHTABLE_POINTER,
+                                                NULL, NULL);
+  profile->group_chats = weechat_hashtable_new(32,
+                                               WEECHAT_HASHTABLE_INTEGER,
+                                               WEECHAT_HASHTABLE_POINTER,
+                                               NULL, NULL);
   profile->friend_requests = twc_list_new();
   profile->group_chat_invites = twc_list_new();
-  profile->message_queues = weechat_hashtable_new(32,
-                                                  WEECHAT_HASHTABLE_INTEGER,
-                                                  WEECHAT_HASHTABLE_POINTER,
-                                                  NULL, NULL);
+  profile->message_queues = NULL;
+  profile->message_queues_size = 0;
+  profile->sending_message_queues = twc_list_new();
+  profile->message_queue_timer = NULL;
+  twc_timer_wheel_init(&profile->message_retry_wheel,
+                       TWC_MESSAGE_QUEUE_RETRY_TICK,
+                       twc_message_queue_retry_callback, profile);
+  profile->queued_message_count = 0;
+  profile->queued_message_bytes = 0;
+  profile->pending_receipt_count = 0;
+  profile->journal = NULL;
+  profile->save = profile->next_save = NULL;
 
   // set up config
   twc_config_init_profile(profile);
@@ -278,6 +274,9 @@ twc_profile_load(struct t_twc_profile *profile)
     if (profile->tox)
         return TWC_RC_ERROR;
 
+    // a save from the last unload may still be writing the data file
+    twc_save_finish(profile);
+
     if (!(profile->buffer))
         {
             // create main buffer
@@ -286,6 +285,8 @@ twc_profile_load(struct t_twc_profile *profile)
                                                  twc_profile_buffer_close_callback, profile);
             if (!(profile->buffer))
                 return TWC_RC_ERROR;
+
+            weechat_hashtable_set(twc_profile_buffers, profile->buffer, profile);
         }
 
     weechat_printf(profile->buffer,
@@ -395,18 +396,23 @@ twc_profile_load(struct t_twc_profile *profile)
                               NULL);
     }
 
+    // cache friend information
+    twc_roster_load(profile);
+    twc_profile_refresh_self(profile);
+
+    // restore messages queued before the last unload or crash
+    twc_journal_open(profile);
+
     // bootstrap DHT
     // TODO: add count to config
     int bootstrap_node_count = 5;
     for (int i = 0; i < bootstrap_node_count; ++i)
         twc_bootstrap_random_node(profile->tox);
 
-    // start tox_iterate loop
-    twc_do_timer_cb(profile, 0);
-
     // register Tox callbacks
     tox_callback_friend_message(profile->tox, twc_friend_message_callback, profile);
     tox_callback_friend_connection_status(profile->tox, twc_connection_status_callback, profile);
+    tox_callback_friend_read_receipt(profile->tox, twc_read_receipt_callback, profile);
     tox_callback_friend_name(profile->tox, twc_name_change_callback, profile);
     tox_callback_friend_status(profile->tox, twc_user_status_callback, profile);
     tox_callback_friend_status_message(profile->tox, twc_status_message_callback, profile);
@@ -416,6 +422,25 @@ twc_profile_load(struct t_twc_profile *profile)
     tox_callback_group_action(profile->tox, twc_group_action_callback, profile);
     tox_callback_group_namelist_change(profile->tox, twc_group_namelist_change_callback, profile);
     tox_callback_group_title(profile->tox, twc_group_title_callback, profile);
+    tox_callback_self_connection_status(profile->tox, twc_self_connection_status_callback, profile);
+
+    // start tox_iterate loop, on a thread of its own if requested
+    profile->iterate_mode =
+        TWC_PROFILE_OPTION_INTEGER(profile, TWC_PROFILE_OPTION_ITERATE_MODE);
+    if (TWC_PROFILE_OPTION_BOOLEAN(profile, TWC_PROFILE_OPTION_THREADED)
+        && twc_worker_start(profile) != TWC_RC_OK)
+    {
+        weechat_printf(profile->buffer,
+                       "%s%s: could not start thread for profile %s; "
+                       "running it on the main thread",
+                       weechat_prefix("error"), weechat_plugin->name,
+                       profile->name);
+    }
+    if (!profile->worker)
+        twc_scheduler_add(profile);
+
+    twc_gui_queue_bar_item_update(TWC_BAR_ITEM_ALL);
+
     return TWC_RC_OK;
 }
 
@@ -429,10 +454,19 @@ twc_profile_unload(struct t_twc_profile *profile)
     if (!(profile->tox))
         return;
 
+    // stop tox_iterate loop
+    twc_scheduler_remove(profile);
+    twc_worker_stop(profile);
+
     // save and kill tox
     int result = twc_profile_save_data_file(profile);
+    twc_journal_close(profile);
     tox_kill(profile->tox);
     profile->tox = NULL;
+    twc_roster_clear(profile->roster);
+    twc_completion_free_profile(profile);
+    free(profile->self_name);
+    profile->self_name = NULL;
 
     if (result == -1)
     {
@@ -445,13 +479,14 @@ twc_profile_unload(struct t_twc_profile *profile)
         free(path);
     }
 
-    // stop Tox timer
-    weechat_unhook(profile->tox_do_timer);
+    // receipts for messages in flight will never arrive now
+    twc_message_queue_reset_profile(profile);
 
     // have to refresh and hide bar items even if we were already offline
-    // TODO
-    twc_profile_refresh_online_status(profile);
+    twc_gui_queue_bar_item_update(TWC_BAR_ITEM_ALL);
     twc_profile_set_online_status(profile, false);
+    if (profile->self_connection != TOX_CONNECTION_NONE)
+        twc_profile_record_connection(profile, TOX_CONNECTION_NONE);
 }
 
 /**
@@ -461,20 +496,138 @@ void
 twc_profile_autoload()
 {
     size_t index;
-    struct t_twc_list_item *item;
-    twc_list_foreach(twc_profiles, index, item)
+    struct t_twc_profile *profile;
+    twc_list_foreach(twc_profiles, index, profile, list_item)
     {
-        if (TWC_PROFILE_OPTION_BOOLEAN(item->profile, TWC_PROFILE_OPTION_AUTOLOAD))
-            twc_profile_load(item->profile);
+        if (TWC_PROFILE_OPTION_BOOLEAN(profile, TWC_PROFILE_OPTION_AUTOLOAD))
+            twc_profile_load(profile);
     }
 }
 
+/**
+ * Run one iteration of a profile's Tox instance. Returns the number of
+ * milliseconds until it wants to be iterated again.
+ */
+long
+twc_profile_iterate(struct t_twc_profile *profile)
+{
+    tox_iterate(profile->tox);
+
+    return twc_profile_iteration_interval(profile);
+}
+
+/**
+ * Return the number of milliseconds until a profile should next be iterated.
+ * Depending on the profile's iterate_mode, this is stretched up to a limit
+ * while the profile is connected, idle and is not sending messages (those
+ * queued for offline friends do not count).
+ */
+long
+twc_profile_iteration_interval(struct t_twc_profile *profile)
+{
+    long interval = tox_iteration_interval(profile->tox);
+    if (interval < 1)
+        interval = 1;
+
+    long max_interval;
+    switch (profile->iterate_mode)
+    {
+        case TWC_ITERATE_MODE_BALANCED:
+            max_interval = 250; break;
+        case TWC_ITERATE_MODE_POWER_SAVE:
+            max_interval = 1000; break;
+        default:
+            return interval;
+    }
+
+    struct t_twc_scheduler_entry *schedule = &profile->schedule;
+    if (profile->self_connection == TOX_CONNECTION_NONE
+        || twc_message_queue_is_sending(profile))
+    {
+        schedule->idle_iterations = 0;
+        return interval;
+    }
+
+    // stay at full speed for a while after any activity, then back off
+    // exponentially
+    ++(schedule->idle_iterations);
+    unsigned int backoff = schedule->idle_iterations;
+    if (backoff <= TWC_PROFILE_IDLE_ITERATIONS)
+        return interval;
+    backoff -= TWC_PROFILE_IDLE_ITERATIONS;
+
+    while (backoff-- && interval < max_interval)
+        interval *= 2;
+
+    return interval < max_interval ? interval : max_interval;
+}
+
+/**
+ * Note inbound activity on a profile. Called from Tox callbacks, with the
+ * Tox instance locked, so the next iteration comes at full speed.
+ */
+void
+twc_profile_activity(struct t_twc_profile *profile)
+{
+    profile->schedule.idle_iterations = 0;
+}
+
+/**
+ * Note user activity on a profile: undo any idle backoff and iterate soon.
+ */
+void
+twc_profile_wake(struct t_twc_profile *profile)
+{
+    if (!profile->tox)
+        return;
+
+    if (profile->worker)
+        twc_worker_wake(profile);
+    else
+        twc_scheduler_wake(profile);
+}
+
+/**
+ * Record a change of a profile's own connection status.
+ */
+void
+twc_profile_record_connection(struct t_twc_profile *profile,
+                              TOX_CONNECTION connection)
+{
+    struct t_twc_connection_transition *transition =
+        &profile->connection_history[profile->connection_history_count
+                                     % TWC_PROFILE_CONNECTION_HISTORY];
+    transition->time = time(NULL);
+    transition->connection = connection;
+    ++(profile->connection_history_count);
+
+    profile->self_connection = connection;
+}
+
+/**
+ * Drop the cached buffer_plugin bar item and queue an update of it.
+ */
 void
 twc_profile_refresh_online_status(struct t_twc_profile *profile)
 {
-    weechat_bar_item_update("buffer_plugin");
-    weechat_bar_item_update("input_prompt");
-    weechat_bar_item_update("away");
+    free(profile->bar_item_buffer_plugin);
+    profile->bar_item_buffer_plugin = NULL;
+    twc_gui_queue_bar_item_update(TWC_BAR_ITEM_BUFFER_PLUGIN);
+}
+
+/**
+ * Cache a profile's own name and status, so that bar items are rendered
+ * without waiting on the Tox instance, and queue an update of their bar
+ * items. Called after setting them, with the Tox instance locked.
+ */
+void
+twc_profile_refresh_self(struct t_twc_profile *profile)
+{
+    free(profile->self_name);
+    profile->self_name = twc_get_self_name_nt(profile->tox);
+    profile->self_status = tox_self_get_status(profile->tox);
+    twc_gui_queue_bar_item_update(TWC_BAR_ITEM_AWAY
+                                  | TWC_BAR_ITEM_INPUT_PROMPT);
 }
 
 void
@@ -512,11 +665,11 @@ struct t_twc_profile *
 twc_profile_search_name(const char *name)
 {
     size_t index;
-    struct t_twc_list_item *item;
-    twc_list_foreach(twc_profiles, index, item)
+    struct t_twc_profile *profile;
+    twc_list_foreach(twc_profiles, index, profile, list_item)
     {
-        if (weechat_strcasecmp(item->profile->name, name) == 0)
-            return item->profile;
+        if (weechat_strcasecmp(profile->name, name) == 0)
+            return profile;
     }
 
     return NULL;
@@ -528,21 +681,14 @@ twc_profile_search_name(const char *name)
 struct t_twc_profile *
 twc_profile_search_buffer(struct t_gui_buffer *buffer)
 {
-    size_t profile_index;
-    struct t_twc_list_item *profile_item;
-    twc_list_foreach(twc_profiles, profile_index, profile_item)
-    {
-        if (profile_item->profile->buffer == buffer)
-            return profile_item->profile;
+    struct t_twc_profile *profile = weechat_hashtable_get(twc_profile_buffers,
+                                                          buffer);
+    if (profile)
+        return profile;
 
-        size_t chat_index;
-        struct t_twc_list_item *chat_item;
-        twc_list_foreach(profile_item->profile->chats, chat_index, chat_item)
-        {
-            if (chat_item->chat->buffer == buffer)
-                return profile_item->profile;
-        }
-    }
+    struct t_twc_chat *chat = twc_chat_search_buffer(buffer);
+    if (chat)
+        return chat->profile;
 
     return NULL;
 }
@@ -556,6 +702,7 @@ twc_profile_delete(struct t_twc_profile *profile,
                    bool delete_data)
 {
     char *data_path = twc_profile_expanded_data_path(profile);
+    char *journal_path = twc_journal_path(profile);
 
     for (size_t i = 0; i < TWC_PROFILE_NUM_OPTIONS; ++i)
         weechat_config_option_free(profile->options[i]);
@@ -563,7 +710,12 @@ twc_profile_delete(struct t_twc_profile *profile,
     twc_profile_free(profile);
 
     if (delete_data)
+    {
         unlink(data_path);
+        unlink(journal_path);
+    }
+    free(data_path);
+    free(journal_path);
 }
 
 /**
@@ -572,26 +724,37 @@ twc_profile_delete(struct t_twc_profile *profile,
 void
 twc_profile_free(struct t_twc_profile *profile)
 {
-    // unload if needed
+    // unload if needed, and wait for the data to be saved
     twc_profile_unload(profile);
+    twc_save_finish(profile);
 
     // close buffer
     if (profile->buffer)
     {
+        weechat_hashtable_remove(twc_profile_buffers, profile->buffer);
         weechat_buffer_set_pointer(profile->buffer, "close_callback", NULL);
         weechat_buffer_close(profile->buffer);
     }
 
     // free things
+    if (profile->chat_refresh_timer)
+        weechat_unhook(profile->chat_refresh_timer);
     twc_chat_free_list(profile->chats);
+    weechat_hashtable_free(profile->friend_chats);
+    weechat_hashtable_free(profile->group_chats);
     twc_friend_request_free_list(profile->friend_requests);
     twc_group_chat_invite_free_list(profile->group_chat_invites);
     twc_message_queue_free_profile(profile);
-    free(profile->name);
-    free(profile);
+    twc_completion_free_profile(profile);
+    twc_roster_free(profile->roster);
 
     // remove from list
-    twc_list_remove_with_data(twc_profiles, profile);
+    twc_list_remove(&profile->list_item);
+
+    free(profile->bar_item_buffer_plugin);
+    free(profile->self_name);
+    free(profile->name);
+    free(profile);
 }
 
 /**
@@ -601,9 +764,11 @@ void
 twc_profile_free_all()
 {
     struct t_twc_profile *profile;
-    while ((profile = twc_list_pop(twc_profiles)))
+    while ((profile = twc_list_pop_data(twc_profiles, struct t_twc_profile,
+                                        list_item)))
         twc_profile_free(profile);
 
     free(twc_profiles);
+    weechat_hashtable_free(twc_profile_buffers);
 }
 
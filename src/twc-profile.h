@@ -21,10 +21,21 @@
 #define TOX_WEECHAT_PROFILE_H
 
 #include <stdbool.h>
+#include <time.h>
 
 #include <tox/tox.h>
 
+#include "twc-list.h"
+#include "twc-scheduler.h"
+#include "twc-timer-wheel.h"
+
 struct t_hashtable;
+struct t_twc_journal;
+struct t_twc_message_queue;
+struct t_twc_roster;
+struct t_twc_save;
+struct t_twc_trie;
+struct t_twc_worker;
 
 enum t_twc_profile_option
 {
@@ -37,10 +48,36 @@ enum t_twc_profile_option
     TWC_PROFILE_OPTION_UDP,
     TWC_PROFILE_OPTION_IPV6,
     TWC_PROFILE_OPTION_PASSPHRASE,
+    TWC_PROFILE_OPTION_THREADED,
+    TWC_PROFILE_OPTION_ITERATE_MODE,
+    TWC_PROFILE_OPTION_COALESCE_MESSAGES,
+    TWC_PROFILE_OPTION_QUEUE_MAX_MESSAGES,
+    TWC_PROFILE_OPTION_QUEUE_MAX_BYTES,
+    TWC_PROFILE_OPTION_QUEUE_TOTAL_MAX_MESSAGES,
+    TWC_PROFILE_OPTION_QUEUE_TOTAL_MAX_BYTES,
+    TWC_PROFILE_OPTION_QUEUE_OVERFLOW,
 
     TWC_PROFILE_NUM_OPTIONS,
 };
 
+#define TWC_PROFILE_CONNECTION_HISTORY 8
+
+enum t_twc_iterate_mode
+{
+    TWC_ITERATE_MODE_LATENCY = 0,
+    TWC_ITERATE_MODE_BALANCED,
+    TWC_ITERATE_MODE_POWER_SAVE,
+};
+
+/**
+ * A change of a profile's own connection status, for diagnostics.
+ */
+struct t_twc_connection_transition
+{
+    time_t time;
+    TOX_CONNECTION connection;
+};
+
 struct t_twc_profile
 {
     char *name;
@@ -48,14 +85,44 @@ struct t_twc_profile
 
     struct Tox *tox;
     int tox_online;
+    TOX_CONNECTION self_connection;
+    struct t_twc_connection_transition connection_history[TWC_PROFILE_CONNECTION_HISTORY];
+    size_t connection_history_count;
 
     struct t_gui_buffer *buffer;
-    struct t_hook *tox_do_timer;
+    char *bar_item_buffer_plugin;
+    // own name and status, for bar items (see twc_profile_refresh_self)
+    char *self_name;
+    TOX_USER_STATUS self_status;
+    struct t_twc_scheduler_entry schedule;
+    struct t_twc_worker *worker;
+    enum t_twc_iterate_mode iterate_mode;
+
+    struct t_twc_roster *roster;
+    struct t_twc_trie *completion_names;
+    struct t_twc_trie *completion_ids;
+    unsigned int completion_generation;
 
     struct t_twc_list *chats;
+    struct t_twc_chat *dirty_chats;
+    struct t_hook *chat_refresh_timer;
+    struct t_hashtable *friend_chats;
+    struct t_hashtable *group_chats;
     struct t_twc_list *friend_requests;
     struct t_twc_list *group_chat_invites;
-    struct t_hashtable *message_queues;
+    struct t_twc_message_queue **message_queues;
+    size_t message_queues_size;
+    struct t_twc_list *sending_message_queues;
+    struct t_hook *message_queue_timer;
+    struct t_twc_timer_wheel message_retry_wheel;
+    size_t queued_message_count;
+    size_t queued_message_bytes;
+    size_t pending_receipt_count;
+    struct t_twc_journal *journal;
+    struct t_twc_save *save;
+    struct t_twc_save *next_save;
+
+    struct t_twc_list_item list_item;
 };
 
 extern struct t_twc_list *twc_profiles;
@@ -103,12 +170,34 @@ twc_profile_unload(struct t_twc_profile *profile);
 void
 twc_profile_autoload();
 
+char *
+twc_profile_expanded_data_path(struct t_twc_profile *profile);
+
 int
 twc_profile_save_data_file(struct t_twc_profile *profile);
 
+long
+twc_profile_iterate(struct t_twc_profile *profile);
+
+long
+twc_profile_iteration_interval(struct t_twc_profile *profile);
+
+void
+twc_profile_activity(struct t_twc_profile *profile);
+
+void
+twc_profile_wake(struct t_twc_profile *profile);
+
+void
+twc_profile_record_connection(struct t_twc_profile *profile,
+                              TOX_CONNECTION connection);
+
 void
 twc_profile_refresh_online_status(struct t_twc_profile *profile);
 
+void
+twc_profile_refresh_self(struct t_twc_profile *profile);
+
 void
 twc_profile_set_online_status(struct t_twc_profile *profile, bool online);
 
@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include <weechat/weechat-plugin.h>
+#include <tox/tox.h>
+
+#include "twc.h"
+#include "twc-profile.h"
+#include "twc-config.h"
+#include "twc-key-map.h"
+#include "twc-utils.h"
+
+#include "twc-roster.h"
+
+/**
+ * Create a new, empty roster.
+ */
+struct t_twc_roster *
+twc_roster_new()
+{
+    struct t_twc_roster *roster = malloc(sizeof(struct t_twc_roster));
+    if (!roster)
+        return NULL;
+
+    roster->size = roster->count = 0;
+    roster->friends = NULL;
+    roster->generation = 0;
+
+    roster->names = weechat_hashtable_new(256,
+                                          WEECHAT_HASHTABLE_STRING,
+                                          WEECHAT_HASHTABLE_POINTER,
+                                          NULL, NULL);
+    roster->keys = twc_key_map_new(256);
+    if (!roster->names || !roster->keys)
+    {
+        if (roster->names)
+            weechat_hashtable_free(roster->names);
+        if (roster->keys)
+            twc_key_map_free(roster->keys);
+        free(roster);
+        return NULL;
+    }
+
+    return roster;
+}
+
+/**
+ * Add a friend to the name index under its current display name.
+ */
+void
+twc_roster_index_name(struct t_twc_roster *roster,
+                      struct t_twc_friend *friend)
+{
+    const char *name = friend->name && friend->name[0] ? friend->name
+                                                       : friend->short_id;
+    ++(roster->generation);
+
+    friend->folded_name = strdup(name);
+    if (!friend->folded_name)
+        return;
+    weechat_string_tolower(friend->folded_name);
+
+    friend->next_same_name = weechat_hashtable_get(roster->names,
+                                                   friend->folded_name);
+    weechat_hashtable_set(roster->names, friend->folded_name, friend);
+}
+
+/**
+ * Remove a friend from the name index.
+ */
+void
+twc_roster_unindex_name(struct t_twc_roster *roster,
+                        struct t_twc_friend *friend)
+{
+    if (!friend->folded_name)
+        return;
+
+    ++(roster->generation);
+
+    struct t_twc_friend *head = weechat_hashtable_get(roster->names,
+                                                      friend->folded_name);
+    if (head == friend)
+    {
+        if (friend->next_same_name)
+            weechat_hashtable_set(roster->names, friend->folded_name,
+                                  friend->next_same_name);
+        else
+            weechat_hashtable_remove(roster->names, friend->folded_name);
+    }
+    else
+    {
+        for (; head; head = head->next_same_name)
+        {
+            if (head->next_same_name == friend)
+            {
+                head->next_same_name = friend->next_same_name;
+                break;
+            }
+        }
+    }
+
+    free(friend->folded_name);
+    friend->folded_name = NULL;
+    friend->next_same_name = NULL;
+}
+
+/**
+ * Render the short form of a friend's Tox ID according to the current
+ * short_id_size setting.
+ */
+void
+twc_roster_render_short_id(struct t_twc_friend *friend)
+{
+    size_t short_id_length = weechat_config_integer(twc_config_short_id_size);
+    memcpy(friend->short_id, friend->id, short_id_length);
+    friend->short_id[short_id_length] = 0;
+}
+
+/**
+ * Free a roster entry.
+ */
+void
+twc_roster_free_friend(struct t_twc_friend *friend)
+{
+    free(friend->name);
+    free(friend->status_message);
+    free(friend->folded_name);
+    free(friend);
+}
+
+/**
+ * Make room for friend_number in a roster's friend array.
+ */
+enum t_twc_rc
+twc_roster_reserve(struct t_twc_roster *roster, uint32_t friend_number)
+{
+    if (friend_number < roster->size)
+        return TWC_RC_OK;
+
+    size_t new_size = roster->size ? roster->size : 16;
+    while (new_size <= friend_number)
+        new_size *= 2;
+
+    struct t_twc_friend **friends =
+        realloc(roster->friends, new_size * sizeof(struct t_twc_friend *));
+    if (!friends)
+        return TWC_RC_ERROR_MALLOC;
+
+    memset(friends + roster->size, 0,
+           (new_size - roster->size) * sizeof(struct t_twc_friend *));
+    roster->friends = friends;
+    roster->size = new_size;
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Fill a profile's roster with all its friends. Replaces any existing
+ * entries.
+ */
+void
+twc_roster_load(struct t_twc_profile *profile)
+{
+    twc_roster_clear(profile->roster);
+
+    size_t friend_count = tox_self_get_friend_list_size(profile->tox);
+    uint32_t *friend_numbers = malloc(sizeof(uint32_t) * friend_count);
+    if (!friend_numbers)
+        return;
+
+    tox_self_get_friend_list(profile->tox, friend_numbers);
+    for (size_t i = 0; i < friend_count; ++i)
+        twc_roster_add(profile, friend_numbers[i]);
+
+    free(friend_numbers);
+}
+
+/**
+ * Add a friend to a profile's roster, or refresh its entry, with information
+ * from toxcore. Returns the entry, or NULL on error.
+ */
+struct t_twc_friend *
+twc_roster_add(struct t_twc_profile *profile, uint32_t friend_number)
+{
+    struct t_twc_roster *roster = profile->roster;
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    TOX_ERR_FRIEND_GET_PUBLIC_KEY err;
+    tox_friend_get_public_key(profile->tox, friend_number, public_key, &err);
+    if (err != TOX_ERR_FRIEND_GET_PUBLIC_KEY_OK)
+        return NULL;
+
+    if (twc_roster_reserve(roster, friend_number) != TWC_RC_OK)
+        return NULL;
+
+    struct t_twc_friend *friend = roster->friends[friend_number];
+    if (!friend)
+    {
+        friend = malloc(sizeof(struct t_twc_friend));
+        if (!friend)
+            return NULL;
+
+        friend->friend_number = friend_number;
+        friend->name = friend->status_message = NULL;
+        friend->folded_name = NULL;
+        friend->next_same_name = NULL;
+        roster->friends[friend_number] = friend;
+        ++(roster->count);
+    }
+    else if (twc_key_map_get(roster->keys, friend->public_key) == friend)
+    {
+        twc_key_map_remove(roster->keys, friend->public_key);
+    }
+
+    memcpy(friend->public_key, public_key, TOX_PUBLIC_KEY_SIZE);
+    ++(roster->generation);
+    twc_key_map_set(roster->keys, public_key, friend);
+    twc_bin2hex(public_key, TOX_PUBLIC_KEY_SIZE, friend->id);
+    twc_roster_render_short_id(friend);
+
+    uint8_t name[TOX_MAX_NAME_LENGTH];
+    TOX_ERR_FRIEND_QUERY query_err;
+    size_t length = tox_friend_get_name_size(profile->tox, friend_number,
+                                             &query_err);
+    if (query_err != TOX_ERR_FRIEND_QUERY_OK || length > TOX_MAX_NAME_LENGTH
+        || !tox_friend_get_name(profile->tox, friend_number, name, NULL))
+        length = 0;
+    twc_roster_set_name(profile, friend_number, name, length);
+
+    free(friend->status_message);
+    friend->status_message = twc_get_status_message_nt(profile->tox,
+                                                       friend_number);
+
+    friend->connection = tox_friend_get_connection_status(profile->tox,
+                                                          friend_number,
+                                                          NULL);
+
+    return friend;
+}
+
+/**
+ * Remove a friend from a profile's roster.
+ */
+void
+twc_roster_remove(struct t_twc_profile *profile, uint32_t friend_number)
+{
+    struct t_twc_roster *roster = profile->roster;
+    struct t_twc_friend *friend = twc_roster_get(profile, friend_number);
+    if (!friend)
+        return;
+
+    twc_roster_unindex_name(roster, friend);
+    if (twc_key_map_get(roster->keys, friend->public_key) == friend)
+        twc_key_map_remove(roster->keys, friend->public_key);
+
+    roster->friends[friend_number] = NULL;
+    --(roster->count);
+    ++(roster->generation);
+    twc_roster_free_friend(friend);
+}
+
+/**
+ * Get the roster entry of a friend, or NULL if there is none.
+ */
+struct t_twc_friend *
+twc_roster_get(struct t_twc_profile *profile, uint32_t friend_number)
+{
+    struct t_twc_roster *roster = profile->roster;
+    if (friend_number >= roster->size)
+        return NULL;
+
+    return roster->friends[friend_number];
+}
+
+/**
+ * Find a friend by display name, ignoring case. If several friends share the
+ * name, one of them is returned and ambiguous is set to true.
+ */
+struct t_twc_friend *
+twc_roster_search_name(struct t_twc_profile *profile, const char *name,
+                       bool *ambiguous)
+{
+    char *folded_name = strdup(name);
+    if (!folded_name)
+        return NULL;
+    weechat_string_tolower(folded_name);
+
+    struct t_twc_friend *friend = weechat_hashtable_get(profile->roster->names,
+                                                        folded_name);
+    free(folded_name);
+
+    if (ambiguous)
+        *ambiguous = friend && friend->next_same_name;
+
+    return friend;
+}
+
+/**
+ * Find a friend by public key. Returns NULL if there is none.
+ */
+struct t_twc_friend *
+twc_roster_search_key(struct t_twc_profile *profile,
+                      const uint8_t *public_key)
+{
+    return twc_key_map_get(profile->roster->keys, public_key);
+}
+
+/**
+ * Return the name of a friend, or its short Tox ID if it has no name. The
+ * returned string is owned by the roster.
+ */
+const char *
+twc_roster_name(struct t_twc_profile *profile, uint32_t friend_number)
+{
+    struct t_twc_friend *friend = twc_roster_get(profile, friend_number);
+    if (!friend)
+        return "<unknown>";
+
+    return friend->name[0] ? friend->name : friend->short_id;
+}
+
+/**
+ * Return the status message of a friend. The returned string is owned by the
+ * roster.
+ */
+const char *
+twc_roster_status_message(struct t_twc_profile *profile,
+                          uint32_t friend_number)
+{
+    struct t_twc_friend *friend = twc_roster_get(profile, friend_number);
+    if (!friend)
+        return "";
+
+    return friend->status_message;
+}
+
+/**
+ * Return the short Tox ID of a friend. The returned string is owned by the
+ * roster.
+ */
+const char *
+twc_roster_short_id(struct t_twc_profile *profile, uint32_t friend_number)
+{
+    struct t_twc_friend *friend = twc_roster_get(profile, friend_number);
+    if (!friend)
+        return "";
+
+    return friend->short_id;
+}
+
+/**
+ * Update the cached name of a friend.
+ */
+void
+twc_roster_set_name(struct t_twc_profile *profile, uint32_t friend_number,
+                    const uint8_t *name, size_t length)
+{
+    struct t_twc_friend *friend = twc_roster_get(profile, friend_number);
+    if (!friend)
+        return;
+
+    twc_roster_unindex_name(profile->roster, friend);
+    free(friend->name);
+    friend->name = twc_null_terminate(name, length);
+    twc_roster_index_name(profile->roster, friend);
+}
+
+/**
+ * Update the cached status message of a friend.
+ */
+void
+twc_roster_set_status_message(struct t_twc_profile *profile,
+                              uint32_t friend_number,
+                              const uint8_t *message, size_t length)
+{
+    struct t_twc_friend *friend = twc_roster_get(profile, friend_number);
+    if (!friend)
+        return;
+
+    free(friend->status_message);
+    friend->status_message = twc_null_terminate(message, length);
+}
+
+/**
+ * Update the cached connection status of a friend.
+ */
+void
+twc_roster_set_connection(struct t_twc_profile *profile,
+                          uint32_t friend_number, TOX_CONNECTION connection)
+{
+    struct t_twc_friend *friend = twc_roster_get(profile, friend_number);
+    if (friend)
+        friend->connection = connection;
+}
+
+/**
+ * Re-render the short Tox IDs of all friends in a profile's roster, e.g.
+ * after short_id_size has changed.
+ */
+void
+twc_roster_refresh_short_ids(struct t_twc_profile *profile)
+{
+    struct t_twc_roster *roster = profile->roster;
+    for (size_t i = 0; i < roster->size; ++i)
+    {
+        struct t_twc_friend *friend = roster->friends[i];
+        if (!friend)
+            continue;
+
+        twc_roster_render_short_id(friend);
+
+        // unnamed friends are indexed by their short ID
+        if (!friend->name || !friend->name[0])
+        {
+            twc_roster_unindex_name(roster, friend);
+            twc_roster_index_name(roster, friend);
+        }
+    }
+}
+
+/**
+ * Remove all friends from a roster.
+ */
+void
+twc_roster_clear(struct t_twc_roster *roster)
+{
+    for (size_t i = 0; i < roster->size; ++i)
+    {
+        struct t_twc_friend *friend = roster->friends[i];
+        if (!friend)
+            continue;
+
+        twc_key_map_remove(roster->keys, friend->public_key);
+        twc_roster_free_friend(friend);
+    }
+
+    weechat_hashtable_remove_all(roster->names);
+    free(roster->friends);
+    ++(roster->generation);
+    roster->friends = NULL;
+    roster->size = roster->count = 0;
+}
+
+/**
+ * Free a roster and all its entries.
+ */
+void
+twc_roster_free(struct t_twc_roster *roster)
+{
+    twc_roster_clear(roster);
+    weechat_hashtable_free(roster->names);
+    twc_key_map_free(roster->keys);
+    free(roster);
+}
+
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TOX_WEECHAT_ROSTER_H
+#define TOX_WEECHAT_ROSTER_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <tox/tox.h>
+
+struct t_twc_profile;
+struct t_twc_key_map;
+struct t_hashtable;
+
+/**
+ * Cached information about a friend, kept up to date by Tox callbacks so that
+ * it can be read without querying toxcore or allocating.
+ */
+struct t_twc_friend
+{
+    uint32_t friend_number;
+
+    char *name;
+    char *status_message;
+    TOX_CONNECTION connection;
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    char id[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    char short_id[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+
+    char *folded_name;
+    struct t_twc_friend *next_same_name;
+};
+
+/**
+ * All friends of a profile, indexed by friend number, case-folded display
+ * name and public key. Friends sharing a folded name are chained through
+ * next_same_name. The generation is bumped whenever a friend is added,
+ * removed or renamed, so that derived caches know when to rebuild.
+ */
+struct t_twc_roster
+{
+    size_t size;
+    size_t count;
+    struct t_twc_friend **friends;
+    unsigned int generation;
+
+    struct t_hashtable *names;
+    struct t_twc_key_map *keys;
+};
+
+struct t_twc_roster *
+twc_roster_new();
+
+void
+twc_roster_load(struct t_twc_profile *profile);
+
+struct t_twc_friend *
+twc_roster_add(struct t_twc_profile *profile, uint32_t friend_number);
+
+void
+twc_roster_remove(struct t_twc_profile *profile, uint32_t friend_number);
+
+struct t_twc_friend *
+twc_roster_get(struct t_twc_profile *profile, uint32_t friend_number);
+
+struct t_twc_friend *
+twc_roster_search_name(struct t_twc_profile *profile, const char *name,
+                       bool *ambiguous);
+
+struct t_twc_friend *
+twc_roster_search_key(struct t_twc_profile *profile,
+                      const uint8_t *public_key);
+
+const char *
+twc_roster_name(struct t_twc_profile *profile, uint32_t friend_number);
+
+const char *
+twc_roster_status_message(struct t_twc_profile *profile,
+                          uint32_t friend_number);
+
+const char *
+twc_roster_short_id(struct t_twc_profile *profile, uint32_t friend_number);
+
+void
+twc_roster_set_name(struct t_twc_profile *profile, uint32_t friend_number,
+                    const uint8_t *name, size_t length);
+
+void
+twc_roster_set_status_message(struct t_twc_profile *profile,
+                              uint32_t friend_number,
+                              const uint8_t *message, size_t length);
+
+void
+twc_roster_set_connection(struct t_twc_profile *profile,
+                          uint32_t friend_number, TOX_CONNECTION connection);
+
+void
+twc_roster_refresh_short_ids(struct t_twc_profile *profile);
+
+void
+twc_roster_clear(struct t_twc_roster *roster);
+
+void
+twc_roster_free(struct t_twc_roster *roster);
+
+#endif // TOX_WEECHAT_ROSTER_H
+
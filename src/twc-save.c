@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <weechat/weechat-plugin.h>
+#include <tox/tox.h>
+#include <tox/toxencryptsave.h>
+
+#include "twc.h"
+#include "twc-profile.h"
+
+#include "twc-save.h"
+
+/**
+ * Free a save, wiping the key material it holds.
+ */
+void
+twc_save_free(struct t_twc_save *save)
+{
+    if (save->data)
+        memset(save->data, 0, save->size);
+    if (save->passphrase)
+        memset(save->passphrase, 0, strlen(save->passphrase));
+
+    free(save->data);
+    free(save->passphrase);
+    free(save->path);
+    free(save);
+}
+
+/**
+ * Record that a step of a save failed, with errno, unless an earlier one
+ * did.
+ */
+void
+twc_save_fail(struct t_twc_save *save, const char *step)
+{
+    if (save->failed)
+        return;
+
+    save->failed = step;
+    save->error = errno;
+}
+
+/**
+ * Write a whole buffer to a file descriptor.
+ */
+bool
+twc_save_write_all(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+/**
+ * Encrypt a save's data if it has a passphrase, write it to a temporary file
+ * next to the data file, sync it and rename it over the data file, so that
+ * a crash leaves either the old or the new data, never a truncated file.
+ */
+void
+twc_save_write(struct t_twc_save *save)
+{
+    const uint8_t *data = save->data;
+    size_t size = save->size;
+
+    uint8_t *encrypted = NULL;
+    if (save->passphrase)
+    {
+        size = save->size + TOX_PASS_ENCRYPTION_EXTRA_LENGTH;
+        encrypted = malloc(size);
+        errno = 0;
+        if (!encrypted
+            || !tox_pass_encrypt(save->data, save->size,
+                                 (uint8_t *)save->passphrase,
+                                 strlen(save->passphrase), encrypted, NULL))
+        {
+            twc_save_fail(save, "encrypting data");
+            free(encrypted);
+            return;
+        }
+        data = encrypted;
+    }
+
+    char tmp_path[strlen(save->path) + sizeof(".tmp")];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", save->path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        twc_save_fail(save, "creating temporary file");
+    else if (!twc_save_write_all(fd, data, size))
+        twc_save_fail(save, "writing");
+    else if (fsync(fd) != 0)
+        twc_save_fail(save, "syncing");
+    if (fd >= 0 && close(fd) != 0)
+        twc_save_fail(save, "writing");
+
+    if (!save->failed && rename(tmp_path, save->path) != 0)
+        twc_save_fail(save, "replacing data file");
+
+    if (save->failed)
+    {
+        if (fd >= 0)
+            unlink(tmp_path);
+    }
+    else
+    {
+        // make the rename itself durable
+        char *slash = strrchr(save->path, '/');
+        if (slash)
+        {
+            char dir_path[slash - save->path + 2];
+            snprintf(dir_path, sizeof(dir_path), "%.*s",
+                     (int)(slash - save->path + 1), save->path);
+            int dir_fd = open(dir_path, O_RDONLY | O_CLOEXEC);
+            if (dir_fd >= 0)
+            {
+                fsync(dir_fd);
+                close(dir_fd);
+            }
+        }
+    }
+
+    if (encrypted)
+    {
+        memset(encrypted, 0, size);
+        free(encrypted);
+    }
+}
+
+/**
+ * Save thread: write the data, then wake the main thread.
+ */
+void *
+twc_save_run(void *data)
+{
+    struct t_twc_save *save = data;
+
+    twc_save_write(save);
+
+    ssize_t rc = write(save->pipe[1], "", 1);
+    (void)rc;
+
+    return NULL;
+}
+
+/**
+ * Start the thread for a save, with a pipe for it to report back on.
+ */
+enum t_twc_rc
+twc_save_spawn(struct t_twc_save *save)
+{
+    if (pipe(save->pipe) != 0)
+        return TWC_RC_ERROR;
+    fcntl(save->pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(save->pipe[1], F_SETFD, FD_CLOEXEC);
+
+    save->pipe_hook = weechat_hook_fd(save->pipe[0], 1, 0, 0,
+                                      twc_save_pipe_callback, save->profile);
+    if (save->pipe_hook
+        && pthread_create(&save->thread, NULL, twc_save_run, save) == 0)
+        return TWC_RC_OK;
+
+    if (save->pipe_hook)
+        weechat_unhook(save->pipe_hook);
+    close(save->pipe[0]);
+    close(save->pipe[1]);
+
+    return TWC_RC_ERROR;
+}
+
+/**
+ * Report a save that failed.
+ */
+void
+twc_save_print_error(struct t_twc_save *save)
+{
+    weechat_printf(NULL,
+                   "%s%s: could not save Tox data for profile %s to %s: "
+                   "%s failed%s%s",
+                   weechat_prefix("error"), weechat_plugin->name,
+                   save->profile->name, save->path, save->failed,
+                   save->error ? ": " : "",
+                   save->error ? strerror(save->error) : "");
+}
+
+/**
+ * Finish a profile's running save once its thread is done, and start the
+ * save of a newer snapshot, if one was taken in the meantime.
+ */
+void
+twc_save_complete(struct t_twc_profile *profile)
+{
+    struct t_twc_save *save = profile->save;
+
+    pthread_join(save->thread, NULL);
+    weechat_unhook(save->pipe_hook);
+    close(save->pipe[0]);
+    close(save->pipe[1]);
+
+    if (save->failed)
+        twc_save_print_error(save);
+    twc_save_free(save);
+
+    profile->save = profile->next_save;
+    profile->next_save = NULL;
+    if (profile->save && twc_save_spawn(profile->save) != TWC_RC_OK)
+    {
+        profile->save->failed = "starting save";
+        profile->save->error = errno;
+        twc_save_print_error(profile->save);
+        twc_save_free(profile->save);
+        profile->save = NULL;
+    }
+}
+
+/**
+ * Called on the main thread when a save thread is done.
+ */
+int
+twc_save_pipe_callback(void *data, int fd)
+{
+    struct t_twc_profile *profile = data;
+
+    if (profile->save)
+        twc_save_complete(profile);
+
+    return WEECHAT_RC_OK;
+}
+
+/**
+ * Start saving a profile's Tox data. The data is copied right away, so the
+ * Tox instance may change or go away while the save runs; the slow part
+ * (encryption and disk I/O) happens on a thread, and failures are reported
+ * when it is done. Only one save per profile runs at a time: a save started
+ * meanwhile waits for it, replacing any other waiting save.
+ */
+enum t_twc_rc
+twc_save_start(struct t_twc_profile *profile)
+{
+    if (!(profile->tox))
+        return TWC_RC_ERROR;
+
+    struct t_twc_save *save = calloc(1, sizeof(struct t_twc_save));
+    if (!save)
+        return TWC_RC_ERROR_MALLOC;
+
+    save->profile = profile;
+    save->path = twc_profile_expanded_data_path(profile);
+    save->size = tox_get_savedata_size(profile->tox);
+    save->data = malloc(save->size);
+    if (!save->path || !save->data)
+    {
+        twc_save_free(save);
+        return TWC_RC_ERROR_MALLOC;
+    }
+    tox_get_savedata(profile->tox, save->data);
+
+    const char *passphrase =
+        weechat_config_string(profile->options[TWC_PROFILE_OPTION_PASSPHRASE]);
+    if (passphrase)
+        save->passphrase = weechat_string_eval_expression(passphrase,
+                                                          NULL, NULL, NULL);
+
+    // create containing folder if it doesn't exist
+    char *rightmost_slash = strrchr(save->path, '/');
+    if (rightmost_slash)
+    {
+        char *dir_path = weechat_strndup(save->path,
+                                         rightmost_slash - save->path);
+        weechat_mkdir_parents(dir_path, 0755);
+        free(dir_path);
+    }
+
+    if (profile->save)
+    {
+        if (profile->next_save)
+            twc_save_free(profile->next_save);
+        profile->next_save = save;
+        return TWC_RC_OK;
+    }
+
+    if (twc_save_spawn(save) != TWC_RC_OK)
+    {
+        twc_save_free(save);
+        return TWC_RC_ERROR;
+    }
+    profile->save = save;
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Wait for a profile's saves to be written, e.g. before its data file is
+ * read or the plugin goes away.
+ */
+void
+twc_save_finish(struct t_twc_profile *profile)
+{
+    while (profile->save)
+        twc_save_complete(profile);
+}
+
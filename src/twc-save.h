@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TOX_WEECHAT_SAVE_H
+#define TOX_WEECHAT_SAVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "twc.h"
+
+struct t_twc_profile;
+
+/**
+ * A save of a snapshot of a profile's Tox data. The data is encrypted and
+ * written to a temporary file that replaces the data file once it is synced,
+ * on a thread of its own; the thread then signals the main thread through
+ * pipe. failed names the step that failed, if any, and error its errno.
+ */
+struct t_twc_save
+{
+    struct t_twc_profile *profile;
+    char *path;
+    char *passphrase;
+    uint8_t *data;
+    size_t size;
+
+    pthread_t thread;
+    int pipe[2];
+    struct t_hook *pipe_hook;
+
+    const char *failed;
+    int error;
+};
+
+int
+twc_save_pipe_callback(void *data, int fd);
+
+enum t_twc_rc
+twc_save_start(struct t_twc_profile *profile);
+
+void
+twc_save_finish(struct t_twc_profile *profile);
+
+#endif // TOX_WEECHAT_SAVE_H
+
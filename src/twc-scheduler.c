@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+
+#include <weechat/weechat-plugin.h>
+#include <tox/tox.h>
+
+#include "twc.h"
+#include "twc-profile.h"
+
+#include "twc-scheduler.h"
+
+/**
+ * Min-heap of loaded profiles ordered by their next iteration deadline.
+ */
+struct t_twc_profile **twc_scheduler_heap = NULL;
+size_t twc_scheduler_heap_size = 0;
+size_t twc_scheduler_heap_count = 0;
+
+/**
+ * The single timer driving all profiles, and its interval in milliseconds.
+ */
+struct t_hook *twc_scheduler_timer = NULL;
+long twc_scheduler_timer_interval = 0;
+
+int
+twc_scheduler_timer_callback(void *data, int remaining_calls);
+
+/**
+ * Initialize the scheduler.
+ */
+void
+twc_scheduler_init()
+{
+    twc_scheduler_heap = NULL;
+    twc_scheduler_heap_size = twc_scheduler_heap_count = 0;
+    twc_scheduler_timer = NULL;
+    twc_scheduler_timer_interval = 0;
+}
+
+/**
+ * Return the current time of the monotonic clock in microseconds.
+ */
+int64_t
+twc_scheduler_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Account for an iteration starting at now, which was due at the entry's
+ * deadline. Also maintains the wakeups per minute estimate, over windows of
+ * about a minute.
+ */
+void
+twc_scheduler_count_iteration(struct t_twc_scheduler_entry *schedule,
+                              int64_t now)
+{
+    int64_t lateness = now - schedule->deadline;
+    if (lateness > 0)
+    {
+        schedule->lateness_total += lateness;
+        if (lateness > schedule->lateness_max)
+            schedule->lateness_max = lateness;
+    }
+    ++(schedule->iterations);
+
+    if (schedule->rate_window_iterations == 0)
+        schedule->rate_window_start = now;
+    ++(schedule->rate_window_iterations);
+
+    int64_t elapsed = now - schedule->rate_window_start;
+    if (elapsed >= 60 * 1000000)
+    {
+        schedule->wakeups_per_minute =
+            schedule->rate_window_iterations * 60e6 / elapsed;
+        schedule->rate_window_iterations = 0;
+    }
+}
+
+/**
+ * Reset a loaded profile's schedule and statistics, with its first iteration
+ * due now.
+ */
+void
+twc_scheduler_reset(struct t_twc_profile *profile)
+{
+    struct t_twc_scheduler_entry *schedule = &profile->schedule;
+    schedule->deadline = twc_scheduler_now();
+    schedule->interval = tox_iteration_interval(profile->tox);
+    if (schedule->interval < 1)
+        schedule->interval = 1;
+    schedule->idle_iterations = 0;
+    schedule->iterations = 0;
+    schedule->lateness_total = schedule->lateness_max = 0;
+    schedule->rate_window_iterations = 0;
+    schedule->wakeups_per_minute = 0;
+}
+
+/**
+ * Put a profile at a heap position and update its index.
+ */
+void
+twc_scheduler_heap_set(size_t index, struct t_twc_profile *profile)
+{
+    twc_scheduler_heap[index] = profile;
+    profile->schedule.heap_index = index;
+}
+
+/**
+ * Move the profile at index towards the root until the heap is ordered.
+ */
+void
+twc_scheduler_sift_up(size_t index)
+{
+    struct t_twc_profile *profile = twc_scheduler_heap[index];
+    while (index > 0)
+    {
+        size_t parent = (index - 1) / 2;
+        if (twc_scheduler_heap[parent]->schedule.deadline
+            <= profile->schedule.deadline)
+            break;
+
+        twc_scheduler_heap_set(index, twc_scheduler_heap[parent]);
+        index = parent;
+    }
+    twc_scheduler_heap_set(index, profile);
+}
+
+/**
+ * Move the profile at index towards the leaves until the heap is ordered.
+ */
+void
+twc_scheduler_sift_down(size_t index)
+{
+    struct t_twc_profile *profile = twc_scheduler_heap[index];
+    for (;;)
+    {
+        size_t child = index * 2 + 1;
+        if (child >= twc_scheduler_heap_count)
+            break;
+        if (child + 1 < twc_scheduler_heap_count
+            && twc_scheduler_heap[child + 1]->schedule.deadline
+               < twc_scheduler_heap[child]->schedule.deadline)
+            ++child;
+        if (profile->schedule.deadline
+            <= twc_scheduler_heap[child]->schedule.deadline)
+            break;
+
+        twc_scheduler_heap_set(index, twc_scheduler_heap[child]);
+        index = child;
+    }
+    twc_scheduler_heap_set(index, profile);
+}
+
+/**
+ * Hook the scheduler timer so that it fires every interval milliseconds,
+ * unless it already does.
+ */
+void
+twc_scheduler_set_timer(long interval)
+{
+    if (twc_scheduler_timer && interval == twc_scheduler_timer_interval)
+        return;
+
+    if (twc_scheduler_timer)
+        weechat_unhook(twc_scheduler_timer);
+
+    twc_scheduler_timer = weechat_hook_timer(interval, 0, 0,
+                                             twc_scheduler_timer_callback,
+                                             NULL);
+    twc_scheduler_timer_interval = interval;
+}
+
+/**
+ * Update the timer to tick at the shortest iteration interval of all
+ * scheduled profiles, or stop it if there are none. Profiles are iterated
+ * on the first tick at or after their deadline.
+ */
+void
+twc_scheduler_update_timer()
+{
+    if (twc_scheduler_heap_count == 0)
+    {
+        if (twc_scheduler_timer)
+            weechat_unhook(twc_scheduler_timer);
+        twc_scheduler_timer = NULL;
+        twc_scheduler_timer_interval = 0;
+        return;
+    }
+
+    long interval = twc_scheduler_heap[0]->schedule.interval;
+    for (size_t i = 1; i < twc_scheduler_heap_count; ++i)
+    {
+        if (twc_scheduler_heap[i]->schedule.interval < interval)
+            interval = twc_scheduler_heap[i]->schedule.interval;
+    }
+
+    twc_scheduler_set_timer(interval > 0 ? interval : 1);
+}
+
+/**
+ * Timer callback. Iterates every profile whose deadline has (almost) passed
+ * and schedules its next iteration.
+ */
+int
+twc_scheduler_timer_callback(void *data, int remaining_calls)
+{
+    int64_t now = twc_scheduler_now();
+
+    // allow a profile to run up to half a tick early rather than a full tick
+    // late
+    int64_t horizon = now + twc_scheduler_timer_interval * 1000 / 2;
+
+    while (twc_scheduler_heap_count > 0
+           && twc_scheduler_heap[0]->schedule.deadline <= horizon)
+    {
+        struct t_twc_profile *profile = twc_scheduler_heap[0];
+        struct t_twc_scheduler_entry *schedule = &profile->schedule;
+
+        twc_scheduler_count_iteration(schedule, now);
+        schedule->interval = twc_profile_iterate(profile);
+        if (schedule->interval < 1)
+            schedule->interval = 1;
+
+        // the profile may have been unloaded from a callback
+        if (schedule->heap_index == TWC_SCHEDULER_NOT_QUEUED)
+            continue;
+
+        schedule->deadline = now + schedule->interval * 1000;
+        twc_scheduler_sift_down(schedule->heap_index);
+    }
+
+    twc_scheduler_update_timer();
+
+    return WEECHAT_RC_OK;
+}
+
+/**
+ * Start iterating a profile's Tox instance. The first iteration happens on
+ * the next tick.
+ */
+void
+twc_scheduler_add(struct t_twc_profile *profile)
+{
+    struct t_twc_scheduler_entry *schedule = &profile->schedule;
+    twc_scheduler_reset(profile);
+
+    if (twc_scheduler_heap_count == twc_scheduler_heap_size)
+    {
+        size_t size = twc_scheduler_heap_size ? twc_scheduler_heap_size * 2
+                                              : 8;
+        struct t_twc_profile **heap =
+            realloc(twc_scheduler_heap, size * sizeof(struct t_twc_profile *));
+        if (!heap)
+        {
+            schedule->heap_index = TWC_SCHEDULER_NOT_QUEUED;
+            return;
+        }
+
+        twc_scheduler_heap = heap;
+        twc_scheduler_heap_size = size;
+    }
+
+    twc_scheduler_heap_set(twc_scheduler_heap_count++, profile);
+    twc_scheduler_sift_up(schedule->heap_index);
+    twc_scheduler_update_timer();
+}
+
+/**
+ * Bring forward a profile's next iteration to the next tick, and undo any
+ * idle backoff.
+ */
+void
+twc_scheduler_wake(struct t_twc_profile *profile)
+{
+    struct t_twc_scheduler_entry *schedule = &profile->schedule;
+    schedule->idle_iterations = 0;
+
+    if (schedule->heap_index == TWC_SCHEDULER_NOT_QUEUED)
+        return;
+
+    long interval = tox_iteration_interval(profile->tox);
+    if (interval < 1)
+        interval = 1;
+    if (schedule->interval <= interval)
+        return;
+
+    schedule->interval = interval;
+    schedule->deadline = twc_scheduler_now();
+    twc_scheduler_sift_up(schedule->heap_index);
+    twc_scheduler_update_timer();
+}
+
+/**
+ * Stop iterating a profile's Tox instance.
+ */
+void
+twc_scheduler_remove(struct t_twc_profile *profile)
+{
+    size_t index = profile->schedule.heap_index;
+    if (index == TWC_SCHEDULER_NOT_QUEUED)
+        return;
+
+    profile->schedule.heap_index = TWC_SCHEDULER_NOT_QUEUED;
+
+    struct t_twc_profile *last = twc_scheduler_heap[--twc_scheduler_heap_count];
+    if (last != profile)
+    {
+        twc_scheduler_heap_set(index, last);
+        twc_scheduler_sift_down(index);
+        twc_scheduler_sift_up(last->schedule.heap_index);
+    }
+
+    twc_scheduler_update_timer();
+}
+
+/**
+ * Stop the scheduler timer and free the heap.
+ */
+void
+twc_scheduler_end()
+{
+    if (twc_scheduler_timer)
+        weechat_unhook(twc_scheduler_timer);
+    twc_scheduler_timer = NULL;
+
+    free(twc_scheduler_heap);
+    twc_scheduler_heap = NULL;
+    twc_scheduler_heap_size = twc_scheduler_heap_count = 0;
+}
+
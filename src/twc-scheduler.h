@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TOX_WEECHAT_SCHEDULER_H
+#define TOX_WEECHAT_SCHEDULER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct t_twc_profile;
+
+#define TWC_SCHEDULER_NOT_QUEUED SIZE_MAX
+
+/**
+ * Scheduling state and statistics of a profile, embedded in the profile.
+ * Times are in microseconds on the monotonic clock.
+ */
+struct t_twc_scheduler_entry
+{
+    size_t heap_index;
+    int64_t deadline;
+    long interval;
+
+    unsigned int idle_iterations;
+
+    uint64_t iterations;
+    int64_t lateness_total;
+    int64_t lateness_max;
+
+    int64_t rate_window_start;
+    uint64_t rate_window_iterations;
+    double wakeups_per_minute;
+};
+
+void
+twc_scheduler_init();
+
+int64_t
+twc_scheduler_now();
+
+void
+twc_scheduler_reset(struct t_twc_profile *profile);
+
+void
+twc_scheduler_count_iteration(struct t_twc_scheduler_entry *schedule,
+                              int64_t now);
+
+void
+twc_scheduler_add(struct t_twc_profile *profile);
+
+void
+twc_scheduler_wake(struct t_twc_profile *profile);
+
+void
+twc_scheduler_remove(struct t_twc_profile *profile);
+
+void
+twc_scheduler_end();
+
+#endif // TOX_WEECHAT_SCHEDULER_H
+
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <weechat/weechat-plugin.h>
+
+#include "twc.h"
+#include "twc-list.h"
+#include "twc-scheduler.h"
+
+#include "twc-timer-wheel.h"
+
+/**
+ * Initialize an empty timer wheel. callback is called with entries as they
+ * become due.
+ */
+void
+twc_timer_wheel_init(struct t_twc_timer_wheel *wheel, long tick,
+                     t_twc_timer_wheel_callback *callback, void *data)
+{
+    wheel->tick = tick;
+    wheel->position = 0;
+    wheel->count = 0;
+    for (size_t i = 0; i < TWC_TIMER_WHEEL_SLOTS; ++i)
+    {
+        wheel->slots[i].head = wheel->slots[i].tail = NULL;
+        wheel->slots[i].count = 0;
+    }
+    wheel->hook = NULL;
+    wheel->callback = callback;
+    wheel->data = data;
+}
+
+/**
+ * Callback for a timer wheel's WeeChat timer. Turns the wheel by one slot
+ * and fires the entries that are due.
+ */
+int
+twc_timer_wheel_timer_callback(void *data, int remaining)
+{
+    struct t_twc_timer_wheel *wheel = data;
+    wheel->position = (wheel->position + 1) % TWC_TIMER_WHEEL_SLOTS;
+
+    // collect due entries first, callbacks may schedule them again
+    struct t_twc_list due = { 0, NULL, NULL };
+    size_t index;
+    struct t_twc_timer_wheel_entry *entry, *next_entry;
+    twc_list_foreach_safe(&wheel->slots[wheel->position], index,
+                          entry, next_entry, list_item)
+    {
+        if (entry->rounds > 0)
+        {
+            --(entry->rounds);
+            continue;
+        }
+
+        twc_list_remove(&entry->list_item);
+        twc_list_add(&due, &entry->list_item);
+        --(wheel->count);
+    }
+
+    while (due.head)
+    {
+        entry = twc_list_data(due.head, struct t_twc_timer_wheel_entry,
+                              list_item);
+        twc_list_remove(&entry->list_item);
+        wheel->callback(wheel, entry);
+    }
+
+    if (wheel->count == 0 && wheel->hook)
+    {
+        weechat_unhook(wheel->hook);
+        wheel->hook = NULL;
+    }
+
+    return WEECHAT_RC_OK;
+}
+
+/**
+ * Schedule an entry to fire in delay milliseconds, rounded up to a whole
+ * tick. An entry that is already scheduled is moved.
+ */
+void
+twc_timer_wheel_schedule(struct t_twc_timer_wheel *wheel,
+                         struct t_twc_timer_wheel_entry *entry, long delay)
+{
+    twc_timer_wheel_cancel(wheel, entry);
+
+    size_t ticks = delay > 0 ? (delay + wheel->tick - 1) / wheel->tick : 1;
+    entry->rounds = (ticks - 1) / TWC_TIMER_WHEEL_SLOTS;
+    entry->due = twc_scheduler_now() + (int64_t)ticks * wheel->tick * 1000;
+    twc_list_add(&wheel->slots[(wheel->position + ticks) % TWC_TIMER_WHEEL_SLOTS],
+                 &entry->list_item);
+    ++(wheel->count);
+
+    if (!wheel->hook)
+        wheel->hook = weechat_hook_timer(wheel->tick, 0, 0,
+                                         twc_timer_wheel_timer_callback, wheel);
+}
+
+/**
+ * Return true if an entry is waiting on a wheel.
+ */
+bool
+twc_timer_wheel_is_scheduled(struct t_twc_timer_wheel_entry *entry)
+{
+    return entry->list_item.list != NULL;
+}
+
+/**
+ * Remove an entry from a wheel, if it is on it.
+ */
+void
+twc_timer_wheel_cancel(struct t_twc_timer_wheel *wheel,
+                       struct t_twc_timer_wheel_entry *entry)
+{
+    if (!twc_timer_wheel_is_scheduled(entry))
+        return;
+
+    twc_list_remove(&entry->list_item);
+    --(wheel->count);
+}
+
+/**
+ * Remove every entry from a wheel and stop its timer.
+ */
+void
+twc_timer_wheel_clear(struct t_twc_timer_wheel *wheel)
+{
+    for (size_t i = 0; i < TWC_TIMER_WHEEL_SLOTS; ++i)
+    {
+        while (twc_list_pop(&wheel->slots[i]))
+            ;
+    }
+    wheel->count = 0;
+
+    if (wheel->hook)
+    {
+        weechat_unhook(wheel->hook);
+        wheel->hook = NULL;
+    }
+}
+
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TOX_WEECHAT_TIMER_WHEEL_H
+#define TOX_WEECHAT_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "twc-list.h"
+
+#define TWC_TIMER_WHEEL_SLOTS 64
+
+struct t_twc_timer_wheel;
+
+/**
+ * Something scheduled on a timer wheel, embedded in the object it belongs
+ * to. due is the time it fires, in microseconds of twc_scheduler_now.
+ */
+struct t_twc_timer_wheel_entry
+{
+    unsigned int rounds;
+    int64_t due;
+
+    struct t_twc_list_item list_item;
+};
+
+typedef void (t_twc_timer_wheel_callback)(struct t_twc_timer_wheel *wheel,
+                                          struct t_twc_timer_wheel_entry *entry);
+
+/**
+ * A hashed timer wheel: entries are put in the slot the wheel will point to
+ * when they are due, with a count of full turns to wait first, so scheduling
+ * and cancelling are O(1) however many entries there are. The wheel turns
+ * one slot per tick milliseconds, on a WeeChat timer that only runs while
+ * entries are scheduled.
+ */
+struct t_twc_timer_wheel
+{
+    long tick;
+    size_t position;
+    size_t count;
+    struct t_twc_list slots[TWC_TIMER_WHEEL_SLOTS];
+    struct t_hook *hook;
+
+    t_twc_timer_wheel_callback *callback;
+    void *data;
+};
+
+void
+twc_timer_wheel_init(struct t_twc_timer_wheel *wheel, long tick,
+                     t_twc_timer_wheel_callback *callback, void *data);
+
+void
+twc_timer_wheel_schedule(struct t_twc_timer_wheel *wheel,
+                         struct t_twc_timer_wheel_entry *entry, long delay);
+
+bool
+twc_timer_wheel_is_scheduled(struct t_twc_timer_wheel_entry *entry);
+
+void
+twc_timer_wheel_cancel(struct t_twc_timer_wheel *wheel,
+                       struct t_twc_timer_wheel_entry *entry);
+
+void
+twc_timer_wheel_clear(struct t_twc_timer_wheel *wheel);
+
+#endif // TOX_WEECHAT_TIMER_WHEEL_H
+
@@ -25,33 +25,15 @@
 #include "twc.h"
 #include "twc-profile.h"
 #include "twc-chat.h"
+#include "twc-key-map.h"
 #include "twc-friend-request.h"
 #include "twc-group-invite.h"
 #include "twc-message-queue.h"
+#include "twc-roster.h"
 #include "twc-utils.h"
 
 #include "twc-tox-callbacks.h"
 
-int
-twc_do_timer_cb(void *data,
-                int remaining_calls)
-{
-    struct t_twc_profile *profile = data;
-
-    tox_iterate(profile->tox);
-    struct t_hook *hook = weechat_hook_timer(tox_iteration_interval(profile->tox),
-                                             0, 1, twc_do_timer_cb, profile);
-    profile->tox_do_timer = hook;
-
-    // check connection status
-    TOX_CONNECTION connection = tox_self_get_connection_status(profile->tox);
-    bool is_connected = connection == TOX_CONNECTION_TCP
-                        || connection == TOX_CONNECTION_UDP;
-    twc_profile_set_online_status(profile, is_connected);
-
-    return WEECHAT_RC_OK;
-}
-
 void
 twc_friend_message_callback(Tox *tox, uint32_t friend_number,
                             TOX_MESSAGE_TYPE type,
@@ -59,17 +41,18 @@ twc_friend_message_callback(Tox *tox, uint32_t friend_number,
                             void *data)
 {
     struct t_twc_profile *profile = data;
+    twc_profile_activity(profile);
+
     struct t_twc_chat *chat = twc_chat_search_friend(profile,
                                                      friend_number,
                                                      true);
 
-    char *name = twc_get_name_nt(profile->tox, friend_number);
+    const char *name = twc_roster_name(profile, friend_number);
     char *message_nt = twc_null_terminate(message, length);
 
     twc_chat_print_message(chat, "", name,
                            message_nt, type);
 
-    free(name);
     free(message_nt);
 }
 
@@ -78,17 +61,26 @@ twc_connection_status_callback(Tox *tox, uint32_t friend_number,
                                TOX_CONNECTION status, void *data)
 {
     struct t_twc_profile *profile = data;
-    char *name = twc_get_name_nt(profile->tox, friend_number);
+    twc_profile_activity(profile);
+
+    const char *name = twc_roster_name(profile, friend_number);
+
+    // the status also changes between TCP and UDP while online
+    struct t_twc_friend *friend = twc_roster_get(profile, friend_number);
+    TOX_CONNECTION previous = friend ? friend->connection
+                                     : TOX_CONNECTION_NONE;
+    twc_roster_set_connection(profile, friend_number, status);
 
     // TODO: print in friend's buffer if it exists
-    if (status == 0)
+    if (status == TOX_CONNECTION_NONE)
     {
         weechat_printf(profile->buffer,
                        "%s%s just went offline.",
                        weechat_prefix("network"),
                        name);
+        twc_message_queue_reset_friend(profile, friend_number);
     }
-    else if (status == 1)
+    else if (previous == TOX_CONNECTION_NONE)
     {
         weechat_printf(profile->buffer,
                        "%s%s just came online.",
@@ -96,7 +88,16 @@ twc_connection_status_callback(Tox *tox, uint32_t friend_number,
                        name);
         twc_message_queue_flush_friend(profile, friend_number);
     }
-    free(name);
+}
+
+void
+twc_read_receipt_callback(Tox *tox, uint32_t friend_number,
+                          uint32_t message_id, void *data)
+{
+    struct t_twc_profile *profile = data;
+    twc_profile_activity(profile);
+
+    twc_message_queue_read_receipt(profile, friend_number, message_id);
 }
 
 void
@@ -105,11 +106,13 @@ twc_name_change_callback(Tox *tox, uint32_t friend_number,
                          void *data)
 {
     struct t_twc_profile *profile = data;
+    twc_profile_activity(profile);
+
     struct t_twc_chat *chat = twc_chat_search_friend(profile,
                                                      friend_number,
                                                      false);
 
-    char *old_name = twc_get_name_nt(profile->tox, friend_number);
+    const char *old_name = twc_roster_name(profile, friend_number);
     char *new_name = twc_null_terminate(name, length);
 
     if (strcmp(old_name, new_name) != 0)
@@ -130,7 +133,8 @@ twc_name_change_callback(Tox *tox, uint32_t friend_number,
                        old_name, new_name);
     }
 
-    free(old_name);
+    twc_roster_set_name(profile, friend_number, name, length);
+
     free(new_name);
 }
 
@@ -139,6 +143,8 @@ twc_user_status_callback(Tox *tox, uint32_t friend_number,
                          TOX_USER_STATUS status, void *data)
 {
     struct t_twc_profile *profile = data;
+    twc_profile_activity(profile);
+
     struct t_twc_chat *chat = twc_chat_search_friend(profile,
                                                      friend_number,
                                                      false);
@@ -152,6 +158,10 @@ twc_status_message_callback(Tox *tox, uint32_t friend_number,
                             void *data)
 {
     struct t_twc_profile *profile = data;
+    twc_profile_activity(profile);
+
+    twc_roster_set_status_message(profile, friend_number, message, length);
+
     struct t_twc_chat *chat = twc_chat_search_friend(profile,
                                                      friend_number,
                                                      false);
@@ -165,6 +175,7 @@ twc_friend_request_callback(Tox *tox, const uint8_t *public_key,
                             void *data)
 {
     struct t_twc_profile *profile = data;
+    twc_profile_activity(profile);
 
     char *message_nt = twc_null_terminate(message, length);
     int rc = twc_friend_request_add(profile, public_key, message_nt);
@@ -205,7 +216,9 @@ twc_group_invite_callback(Tox *tox,
                           void *data)
 {
     struct t_twc_profile *profile = data;
-    char *friend_name = twc_get_name_nt(profile->tox, friend_number);
+    twc_profile_activity(profile);
+
+    const char *friend_name = twc_roster_name(profile, friend_number);
 
     int64_t rc = twc_group_chat_invite_add(profile, friend_number, type,
                                            (uint8_t *)invite_data, length);
@@ -235,8 +248,6 @@ twc_group_invite_callback(Tox *tox,
                        "process it; try again",
                        weechat_prefix("error"), friend_name, rc);
     }
-
-    free(friend_name);
 }
 
 void
@@ -247,6 +258,7 @@ twc_handle_group_message(Tox *tox,
                          enum TWC_MESSAGE_TYPE message_type)
 {
     struct t_twc_profile *profile = data;
+    twc_profile_activity(profile);
 
     struct t_twc_chat *chat = twc_chat_search_group(profile,
                                                     group_number,
@@ -292,36 +304,34 @@ twc_group_action_callback(Tox *tox,
                              TWC_MESSAGE_TYPE_ACTION);
 }
 
+/**
+ * Update a group chat's nicklist for a peer joining, leaving or changing
+ * name. name and pubkey are the peer's current name and public key, or NULL
+ * if they are unknown.
+ */
 void
-twc_group_namelist_change_callback(Tox *tox,
-                                   int group_number, int peer_number,
-                                   uint8_t change_type,
-                                   void *data)
+twc_handle_group_namelist_change(struct t_twc_profile *profile,
+                                 int group_number, uint8_t change_type,
+                                 const char *name, const uint8_t *pubkey)
 {
-    struct t_twc_profile *profile = data;
     struct t_twc_chat *chat = twc_chat_search_group(profile,
                                                     group_number,
                                                     true);
 
     struct t_gui_nick *nick = NULL;
-    char *name = twc_get_peer_name_nt(profile->tox, group_number, peer_number);
     char *prev_name = NULL;
 
-    uint8_t pubkey[TOX_PUBLIC_KEY_SIZE];
-    int pkrc = tox_group_peer_pubkey(profile->tox, group_number,
-                                     peer_number, pubkey);
-    if (pkrc == 0)
+    if (pubkey)
     {
         if (change_type == TOX_CHAT_CHANGE_PEER_DEL
             || change_type == TOX_CHAT_CHANGE_PEER_NAME)
         {
-            nick = weechat_hashtable_get(chat->nicks, pubkey);
+            nick = twc_key_map_remove(chat->nicks, pubkey);
             if (nick)
             {
                 prev_name = strdup(weechat_nicklist_nick_get_string(chat->buffer,
                                                                     nick, "name"));
                 weechat_nicklist_remove_nick(chat->buffer, nick);
-                weechat_hashtable_remove(chat->nicks, pubkey);
             }
         }
 
@@ -329,11 +339,10 @@ twc_group_namelist_change_callback(Tox *tox,
             || change_type == TOX_CHAT_CHANGE_PEER_NAME)
         {
             nick = weechat_nicklist_add_nick(chat->buffer, chat->nicklist_group,
-                                             name, NULL, NULL, NULL, 1);
+                                             name ? name : "<unknown>",
+                                             NULL, NULL, NULL, 1);
             if (nick)
-                weechat_hashtable_set_with_size(chat->nicks,
-                                                pubkey, TOX_PUBLIC_KEY_SIZE,
-                                                nick, 0);
+                twc_key_map_set(chat->nicks, pubkey, nick);
         }
     }
 
@@ -360,6 +369,28 @@ twc_group_namelist_change_callback(Tox *tox,
         free(prev_name);
 }
 
+void
+twc_group_namelist_change_callback(Tox *tox,
+                                   int group_number, int peer_number,
+                                   uint8_t change_type,
+                                   void *data)
+{
+    struct t_twc_profile *profile = data;
+    twc_profile_activity(profile);
+
+    uint8_t name[TOX_MAX_NAME_LENGTH + 1];
+    int length = tox_group_peername(tox, group_number, peer_number, name);
+    if (length >= 0)
+        name[length] = 0;
+
+    uint8_t pubkey[TOX_PUBLIC_KEY_SIZE];
+    int pkrc = tox_group_peer_pubkey(tox, group_number, peer_number, pubkey);
+
+    twc_handle_group_namelist_change(profile, group_number, change_type,
+                                     length >= 0 ? (char *)name : NULL,
+                                     pkrc == 0 ? pubkey : NULL);
+}
+
 void
 twc_group_title_callback(Tox *tox,
                          int group_number, int peer_number,
@@ -367,6 +398,8 @@ twc_group_title_callback(Tox *tox,
                          void *data)
 {
     struct t_twc_profile *profile = data;
+    twc_profile_activity(profile);
+
     struct t_twc_chat *chat = twc_chat_search_group(profile,
                                                     group_number,
                                                     true);
@@ -383,3 +416,18 @@ twc_group_title_callback(Tox *tox,
     }
 }
 
+void
+twc_self_connection_status_callback(Tox *tox, TOX_CONNECTION status,
+                                    void *data)
+{
+    struct t_twc_profile *profile = data;
+    twc_profile_activity(profile);
+
+    twc_profile_record_connection(profile, status);
+    twc_profile_set_online_status(profile, status != TOX_CONNECTION_NONE);
+
+    // friends may have come online before we noticed; try their queues
+    if (status != TOX_CONNECTION_NONE)
+        twc_message_queue_flush_profile(profile);
+}
+
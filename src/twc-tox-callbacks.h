@@ -22,9 +22,7 @@
 
 #include <tox/tox.h>
 
-int
-twc_do_timer_cb(void *data,
-                int remaining_calls);
+struct t_twc_profile;
 
 void
 twc_friend_message_callback(Tox *tox, uint32_t friend_number,
@@ -36,6 +34,10 @@ void
 twc_connection_status_callback(Tox *tox, uint32_t friend_number,
                                TOX_CONNECTION status, void *data);
 
+void
+twc_read_receipt_callback(Tox *tox, uint32_t friend_number,
+                          uint32_t message_id, void *data);
+
 void
 twc_name_change_callback(Tox *tox, uint32_t friend_number,
                          const uint8_t *name, size_t length,
@@ -73,6 +75,11 @@ twc_group_action_callback(Tox *tox,
                           const uint8_t *message, uint16_t length,
                           void *data);
 
+void
+twc_handle_group_namelist_change(struct t_twc_profile *profile,
+                                 int group_number, uint8_t change_type,
+                                 const char *name, const uint8_t *pubkey);
+
 void
 twc_group_namelist_change_callback(Tox *tox,
                                    int group_number, int peer_number,
@@ -85,5 +92,9 @@ twc_group_title_callback(Tox *tox,
                          const uint8_t *title, uint8_t length,
                          void *data);
 
+void
+twc_self_connection_status_callback(Tox *tox, TOX_CONNECTION status,
+                                    void *data);
+
 #endif // TOX_WEECHAT_TOX_CALLBACKS_H
 
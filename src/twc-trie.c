@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "twc.h"
+
+#include "twc-trie.h"
+
+/**
+ * Fold the case of an ASCII character.
+ */
+char
+twc_trie_fold(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/**
+ * Create a new, empty trie.
+ */
+struct t_twc_trie *
+twc_trie_new()
+{
+    struct t_twc_trie *trie = calloc(1, sizeof(struct t_twc_trie));
+    return trie;
+}
+
+/**
+ * Create a node with a case-folded copy of the first length bytes of label.
+ */
+struct t_twc_trie_node *
+twc_trie_node_new(const char *label, size_t length)
+{
+    struct t_twc_trie_node *node = calloc(1, sizeof(struct t_twc_trie_node));
+    if (!node)
+        return NULL;
+
+    node->label = malloc(length);
+    if (!node->label)
+    {
+        free(node);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < length; ++i)
+        node->label[i] = twc_trie_fold(label[i]);
+    node->label_length = length;
+
+    return node;
+}
+
+/**
+ * Return a pointer to the link leading to the child of node whose label
+ * starts with c, or to the link where such a child would be inserted.
+ */
+struct t_twc_trie_node **
+twc_trie_find_child(struct t_twc_trie_node *node, char c)
+{
+    struct t_twc_trie_node **link = &node->first_child;
+    while (*link && (unsigned char)(*link)->label[0] < (unsigned char)c)
+        link = &(*link)->next_sibling;
+
+    return link;
+}
+
+/**
+ * Add a string to the values of a node, keeping them sorted.
+ */
+enum t_twc_rc
+twc_trie_node_add_value(struct t_twc_trie *trie, struct t_twc_trie_node *node,
+                        const char *string)
+{
+    struct t_twc_trie_value **link = &node->values;
+    int cmp = 1;
+    while (*link && (cmp = strcmp((*link)->string, string)) < 0)
+        link = &(*link)->next_value;
+
+    // already present
+    if (*link && cmp == 0)
+        return TWC_RC_OK;
+
+    struct t_twc_trie_value *value = malloc(sizeof(struct t_twc_trie_value));
+    if (!value)
+        return TWC_RC_ERROR_MALLOC;
+
+    value->string = strdup(string);
+    if (!value->string)
+    {
+        free(value);
+        return TWC_RC_ERROR_MALLOC;
+    }
+
+    value->next_value = *link;
+    *link = value;
+    ++(trie->count);
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Insert a string into a trie.
+ */
+enum t_twc_rc
+twc_trie_insert(struct t_twc_trie *trie, const char *string)
+{
+    struct t_twc_trie_node *node = &trie->root;
+    const char *key = string;
+    size_t key_length = strlen(string);
+
+    while (key_length > 0)
+    {
+        char c = twc_trie_fold(key[0]);
+        struct t_twc_trie_node **link = twc_trie_find_child(node, c);
+        struct t_twc_trie_node *child = *link;
+
+        // no child shares a prefix; add the rest of the key as a leaf
+        if (!child || child->label[0] != c)
+        {
+            struct t_twc_trie_node *leaf = twc_trie_node_new(key, key_length);
+            if (!leaf)
+                return TWC_RC_ERROR_MALLOC;
+
+            leaf->next_sibling = child;
+            *link = leaf;
+            node = leaf;
+            break;
+        }
+
+        size_t common = 1;
+        while (common < child->label_length && common < key_length
+               && child->label[common] == twc_trie_fold(key[common]))
+            ++common;
+
+        // split the child at the end of the common prefix
+        if (common < child->label_length)
+        {
+            struct t_twc_trie_node *middle = twc_trie_node_new(child->label,
+                                                               common);
+            if (!middle)
+                return TWC_RC_ERROR_MALLOC;
+
+            memmove(child->label, child->label + common,
+                    child->label_length - common);
+            child->label_length -= common;
+
+            middle->first_child = child;
+            middle->next_sibling = child->next_sibling;
+            child->next_sibling = NULL;
+            *link = middle;
+            child = middle;
+        }
+
+        node = child;
+        key += common;
+        key_length -= common;
+    }
+
+    return twc_trie_node_add_value(trie, node, string);
+}
+
+/**
+ * Call callback for every string stored in or below node, in sorted order.
+ */
+void
+twc_trie_node_walk(struct t_twc_trie_node *node,
+                   void (*callback)(void *data, const char *string),
+                   void *data)
+{
+    for (struct t_twc_trie_value *value = node->values;
+         value; value = value->next_value)
+        callback(data, value->string);
+
+    for (struct t_twc_trie_node *child = node->first_child;
+         child; child = child->next_sibling)
+        twc_trie_node_walk(child, callback, data);
+}
+
+/**
+ * Call callback, in sorted order, for every string in a trie that starts with
+ * prefix, ignoring ASCII case.
+ */
+void
+twc_trie_search_prefix(struct t_twc_trie *trie, const char *prefix,
+                       void (*callback)(void *data, const char *string),
+                       void *data)
+{
+    struct t_twc_trie_node *node = &trie->root;
+    size_t prefix_length = prefix ? strlen(prefix) : 0;
+
+    while (prefix_length > 0)
+    {
+        char c = twc_trie_fold(prefix[0]);
+        struct t_twc_trie_node *child = *twc_trie_find_child(node, c);
+        if (!child || child->label[0] != c)
+            return;
+
+        size_t common = 1;
+        while (common < child->label_length && common < prefix_length
+               && child->label[common] == twc_trie_fold(prefix[common]))
+            ++common;
+
+        // prefix ends inside this child's label
+        if (common == prefix_length)
+        {
+            node = child;
+            break;
+        }
+
+        if (common < child->label_length)
+            return;
+
+        node = child;
+        prefix += common;
+        prefix_length -= common;
+    }
+
+    twc_trie_node_walk(node, callback, data);
+}
+
+/**
+ * Free a node and everything below it.
+ */
+void
+twc_trie_node_free(struct t_twc_trie_node *node)
+{
+    struct t_twc_trie_value *value = node->values;
+    while (value)
+    {
+        struct t_twc_trie_value *next_value = value->next_value;
+        free(value->string);
+        free(value);
+        value = next_value;
+    }
+
+    struct t_twc_trie_node *child = node->first_child;
+    while (child)
+    {
+        struct t_twc_trie_node *next_sibling = child->next_sibling;
+        twc_trie_node_free(child);
+        free(child);
+        child = next_sibling;
+    }
+
+    free(node->label);
+}
+
+/**
+ * Free a trie and all strings in it.
+ */
+void
+twc_trie_free(struct t_twc_trie *trie)
+{
+    twc_trie_node_free(&trie->root);
+    free(trie);
+}
+
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TOX_WEECHAT_TRIE_H
+#define TOX_WEECHAT_TRIE_H
+
+#include <stdlib.h>
+
+#include "twc.h"
+
+/**
+ * A string stored in a trie node. Strings that only differ in case share a
+ * node and are kept in sorted order.
+ */
+struct t_twc_trie_value
+{
+    char *string;
+    struct t_twc_trie_value *next_value;
+};
+
+/**
+ * A node in a radix trie. The label is the (case-folded) part of the key
+ * between the parent and this node. Children are kept sorted by the first
+ * byte of their label, so walking the trie visits keys in sorted order.
+ */
+struct t_twc_trie_node
+{
+    char *label;
+    size_t label_length;
+
+    struct t_twc_trie_value *values;
+
+    struct t_twc_trie_node *first_child;
+    struct t_twc_trie_node *next_sibling;
+};
+
+/**
+ * Sorted set of strings supporting case-insensitive prefix enumeration.
+ */
+struct t_twc_trie
+{
+    struct t_twc_trie_node root;
+    size_t count;
+};
+
+struct t_twc_trie *
+twc_trie_new();
+
+enum t_twc_rc
+twc_trie_insert(struct t_twc_trie *trie, const char *string);
+
+void
+twc_trie_search_prefix(struct t_twc_trie *trie, const char *prefix,
+                       void (*callback)(void *data, const char *string),
+                       void *data);
+
+void
+twc_trie_free(struct t_twc_trie *trie);
+
+#endif // TOX_WEECHAT_TRIE_H
+
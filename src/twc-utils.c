@@ -24,39 +24,95 @@
 #include <tox/tox.h>
 
 #include "twc.h"
-#include "twc-config.h"
 
 #include "twc-utils.h"
 
 /**
- * Convert a hex string to it's binary equivalent of max size bytes.
+ * Value of each character as a hex digit, or X if it is not one.
  */
-void
+#define X 0xFF
+static const uint8_t twc_hex_values[256] =
+{
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  X,  X,  X,  X,  X,  X,
+     X, 10, 11, 12, 13, 14, 15,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X, 10, 11, 12, 13, 14, 15,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+     X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+};
+#undef X
+
+/**
+ * Both upper case hex digits of every byte value.
+ */
+static const char twc_hex_pairs[] =
+    "000102030405060708090A0B0C0D0E0F"
+    "101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F"
+    "303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F"
+    "505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F"
+    "707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F"
+    "909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+    "B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+    "D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+    "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/**
+ * Convert a hex string to its binary equivalent of size bytes. Upper and
+ * lower case digits are accepted.
+ *
+ * Returns the number of hex characters converted. If this is less than
+ * size * 2, hex[return value] is not a hex digit (or the string ended early)
+ * and out is only partially filled.
+ */
+size_t
 twc_hex2bin(const char *hex, size_t size, uint8_t *out)
 {
-    const char *position = hex;
+    const unsigned char *position = (const unsigned char *)hex;
 
-    size_t i;
-    for (i = 0; i < size; ++i)
+    for (size_t i = 0; i < size; ++i)
     {
-        sscanf(position, "%2hhx", &out[i]);
+        uint8_t high = twc_hex_values[position[0]];
+        if (high > 0xF)
+            return i * 2;
+        uint8_t low = twc_hex_values[position[1]];
+        if (low > 0xF)
+            return i * 2 + 1;
+
+        out[i] = high << 4 | low;
         position += 2;
     }
+
+    return size * 2;
 }
 
 /**
- * Convert size bytes to a hex string. out must be at lesat size * 2 + 1
- * bytes.
+ * Convert size bytes to an upper case hex string. out must be at least
+ * size * 2 + 1 bytes.
  */
 void
 twc_bin2hex(const uint8_t *bin, size_t size, char *out)
 {
     char *position = out;
-
-    size_t i;
-    for (i = 0; i < size; ++i)
+    for (size_t i = 0; i < size; ++i)
     {
-        sprintf(position, "%02X", bin[i]);
+        memcpy(position, &twc_hex_pairs[bin[i] * 2], 2);
         position += 2;
     }
     *position = 0;
@@ -75,25 +131,6 @@ twc_null_terminate(const uint8_t *str, size_t length)
     return str_null;
 }
 
-/**
- * Get the null-terminated name of a Tox friend. Must be freed.
- */
-char *
-twc_get_name_nt(Tox *tox, int32_t friend_number)
-{
-    TOX_ERR_FRIEND_QUERY err;
-    size_t length = tox_friend_get_name_size(tox, friend_number, &err);
-
-    if ((err != TOX_ERR_FRIEND_QUERY_OK) ||
-        (length == 0))
-      return twc_get_friend_id_short(tox, friend_number);
-
-    uint8_t name[length];
-
-    tox_friend_get_name(tox, friend_number, name, &err);
-    return twc_null_terminate(name, length);
-}
-
 /**
  * Return the null-terminated status message of a Tox friend. Must be freed.
  */
@@ -146,27 +183,14 @@ twc_get_self_name_nt(Tox *tox)
 }
 
 /**
- * Return a friend's Tox ID in short form. Return value must be freed.
+ * Swap two items in an array of pointers.
  */
-char *
-twc_get_friend_id_short(Tox *tox, int32_t friend_number)
+void
+twc_swap(void **items, size_t a, size_t b)
 {
-    uint8_t client_id[TOX_PUBLIC_KEY_SIZE];
-    TOX_ERR_FRIEND_GET_PUBLIC_KEY err;
-    size_t short_id_length = weechat_config_integer(twc_config_short_id_size);
-    char *hex_address = malloc(short_id_length + 1);
-
-    tox_friend_get_public_key(tox, friend_number, client_id, &err);
-
-    // return a zero public key on failure
-    if (err != TOX_ERR_FRIEND_GET_PUBLIC_KEY_OK)
-      memset(client_id, 0, TOX_PUBLIC_KEY_SIZE);
-
-    twc_bin2hex(client_id,
-                short_id_length / 2,
-                hex_address);
-
-    return hex_address;
+    void *item = items[a];
+    items[a] = items[b];
+    items[b] = item;
 }
 
 /**
@@ -186,15 +210,91 @@ twc_uint32_reverse_bytes(uint32_t num)
 }
 
 /**
- * Hash a Tox ID of size TOX_PUBLIC_KEY_SIZE bytes using a modified djb2 hash.
+ * Return the length in bytes of the first chunk of a UTF-8 string when it is
+ * split into chunks of at most max_length bytes. The chunk ends on a
+ * codepoint boundary, and before the last whitespace in it if there is one
+ * in its last quarter; further back, it would cost a nearly empty chunk. The
+ * whitespace itself is left for the caller to skip.
+ */
+size_t
+twc_utf8_split_length(const char *text, size_t length, size_t max_length)
+{
+    if (length <= max_length)
+        return length;
+
+    // back up to the start of a codepoint
+    size_t cut = max_length;
+    while (cut > 0 && (text[cut] & 0xC0) == 0x80)
+        --cut;
+    if (cut == 0)
+        return max_length;
+
+    size_t limit = cut - cut / 4;
+    for (size_t i = cut; i > 0 && i >= limit; --i)
+    {
+        if (text[i] == ' ' || text[i] == '\t' || text[i] == '\n')
+            return i;
+    }
+
+    return cut;
+}
+
+/**
+ * Rearrange items[begin..end) so that items[nth] is the item that would be
+ * there if the range were sorted, with no greater item before it and no
+ * smaller item after it.
+ */
+void
+twc_select(void **items, size_t begin, size_t end, size_t nth,
+           int (*compare)(const void *, const void *))
+{
+    while (end - begin > 1)
+    {
+        // median of three as pivot, moved to the end of the range
+        size_t middle = begin + (end - begin) / 2;
+        if (compare(&items[middle], &items[begin]) < 0)
+            twc_swap(items, middle, begin);
+        if (compare(&items[end - 1], &items[begin]) < 0)
+            twc_swap(items, end - 1, begin);
+        if (compare(&items[middle], &items[end - 1]) < 0)
+            twc_swap(items, middle, end - 1);
+
+        size_t store = begin;
+        for (size_t i = begin; i < end - 1; ++i)
+        {
+            if (compare(&items[i], &items[end - 1]) < 0)
+                twc_swap(items, i, store++);
+        }
+        twc_swap(items, store, end - 1);
+
+        if (nth == store)
+            return;
+        else if (nth < store)
+            end = store;
+        else
+            begin = store + 1;
+    }
+}
+
+/**
+ * Sort only the items that end up in positions [first, last) of a sorted
+ * array of count pointers, leaving the others in unspecified order. compare
+ * is called with pointers to the array elements, as for qsort.
  */
-unsigned long long
-twc_hash_tox_id(const uint8_t *tox_id)
+void
+twc_partial_sort(void **items, size_t count, size_t first, size_t last,
+                 int (*compare)(const void *, const void *))
 {
-    unsigned long long hash = 5381;
+    if (last > count)
+        last = count;
+    if (first >= last)
+        return;
 
-    for (size_t i = 0; i < TOX_PUBLIC_KEY_SIZE; ++i)
-        hash ^= (hash << 5) + (hash >> 2) + tox_id[i];
+    if (last < count)
+        twc_select(items, 0, count, last, compare);
+    if (first > 0)
+        twc_select(items, 0, last, first, compare);
 
-    return hash;
+    qsort(items + first, last - first, sizeof(void *), compare);
 }
+
@@ -24,7 +24,7 @@
 
 #include <tox/tox.h>
 
-void
+size_t
 twc_hex2bin(const char *hex, size_t size, uint8_t *out);
 
 void
@@ -33,9 +33,6 @@ twc_bin2hex(const uint8_t *bin, size_t size, char *out);
 char *
 twc_null_terminate(const uint8_t *str, size_t length);
 
-char *
-twc_get_name_nt(Tox *tox, int32_t friend_number);
-
 char *
 twc_get_status_message_nt(Tox *tox, int32_t friend_number);
 
@@ -45,14 +42,15 @@ twc_get_peer_name_nt(Tox *tox, int32_t group_number, int32_t peer_number);
 char *
 twc_get_self_name_nt(Tox *tox);
 
-char *
-twc_get_friend_id_short(Tox *tox, int32_t friend_number);
-
 uint32_t
 twc_uint32_reverse_bytes(uint32_t num);
 
-unsigned long long
-twc_hash_tox_id(const uint8_t *tox_id);
+size_t
+twc_utf8_split_length(const char *text, size_t length, size_t max_length);
+
+void
+twc_partial_sort(void **items, size_t count, size_t first, size_t last,
+                 int (*compare)(const void *, const void *));
 
 #endif // TOX_WEECHAT_UTILS_H
 
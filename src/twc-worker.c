@@ -0,0 +1,582 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <weechat/weechat-plugin.h>
+#include <tox/tox.h>
+
+#include "twc.h"
+#include "twc-profile.h"
+#include "twc-scheduler.h"
+#include "twc-tox-callbacks.h"
+
+#include "twc-worker.h"
+
+/**
+ * Record an event on the worker thread. data is copied. Wakes the main
+ * thread if it is not already about to drain the ring.
+ */
+void
+twc_worker_push(struct t_twc_worker *worker, struct t_twc_event *event,
+                const uint8_t *data, size_t length)
+{
+    twc_profile_activity(worker->profile);
+
+    event->data = NULL;
+    event->length = length;
+    event->next_event = NULL;
+    if (length > 0)
+    {
+        event->data = malloc(length);
+        if (!event->data)
+            return;
+        memcpy(event->data, data, length);
+    }
+
+    size_t tail = worker->ring_tail;
+    size_t head = __atomic_load_n(&worker->ring_head, __ATOMIC_ACQUIRE);
+    if (!__atomic_load_n(&worker->overflowing, __ATOMIC_ACQUIRE)
+        && tail - head < TWC_WORKER_RING_SIZE)
+    {
+        worker->ring[tail & (TWC_WORKER_RING_SIZE - 1)] = *event;
+        __atomic_store_n(&worker->ring_tail, tail + 1, __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        // the ring is full; keep order by queueing everything in the
+        // overflow list until the main thread has emptied it
+        struct t_twc_event *overflow_event = malloc(sizeof(*overflow_event));
+        if (!overflow_event)
+        {
+            free(event->data);
+            return;
+        }
+        *overflow_event = *event;
+
+        pthread_mutex_lock(&worker->overflow_mutex);
+        if (worker->overflow_last)
+            worker->overflow_last->next_event = overflow_event;
+        else
+            worker->overflow_first = overflow_event;
+        worker->overflow_last = overflow_event;
+        __atomic_store_n(&worker->overflowing, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&worker->overflow_mutex);
+    }
+
+    if (!__atomic_exchange_n(&worker->signalled, 1, __ATOMIC_SEQ_CST))
+    {
+        ssize_t rc = write(worker->pipe[1], "", 1);
+        (void)rc;
+    }
+}
+
+void
+twc_worker_friend_message_callback(Tox *tox, uint32_t friend_number,
+                                   TOX_MESSAGE_TYPE type,
+                                   const uint8_t *message, size_t length,
+                                   void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_FRIEND_MESSAGE,
+                                 .number = friend_number, .value = type };
+    twc_worker_push(data, &event, message, length);
+}
+
+void
+twc_worker_connection_status_callback(Tox *tox, uint32_t friend_number,
+                                      TOX_CONNECTION status, void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_FRIEND_CONNECTION_STATUS,
+                                 .number = friend_number, .value = status };
+    twc_worker_push(data, &event, NULL, 0);
+}
+
+void
+twc_worker_read_receipt_callback(Tox *tox, uint32_t friend_number,
+                                 uint32_t message_id, void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_FRIEND_READ_RECEIPT,
+                                 .number = friend_number,
+                                 .value = (int)message_id };
+    twc_worker_push(data, &event, NULL, 0);
+}
+
+void
+twc_worker_name_change_callback(Tox *tox, uint32_t friend_number,
+                                const uint8_t *name, size_t length,
+                                void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_FRIEND_NAME,
+                                 .number = friend_number };
+    twc_worker_push(data, &event, name, length);
+}
+
+void
+twc_worker_user_status_callback(Tox *tox, uint32_t friend_number,
+                                TOX_USER_STATUS status, void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_FRIEND_STATUS,
+                                 .number = friend_number, .value = status };
+    twc_worker_push(data, &event, NULL, 0);
+}
+
+void
+twc_worker_status_message_callback(Tox *tox, uint32_t friend_number,
+                                   const uint8_t *message, size_t length,
+                                   void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_FRIEND_STATUS_MESSAGE,
+                                 .number = friend_number };
+    twc_worker_push(data, &event, message, length);
+}
+
+void
+twc_worker_friend_request_callback(Tox *tox, const uint8_t *public_key,
+                                   const uint8_t *message, size_t length,
+                                   void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_FRIEND_REQUEST,
+                                 .has_public_key = true };
+    memcpy(event.public_key, public_key, TOX_PUBLIC_KEY_SIZE);
+    twc_worker_push(data, &event, message, length);
+}
+
+void
+twc_worker_group_invite_callback(Tox *tox,
+                                 int32_t friend_number, uint8_t type,
+                                 const uint8_t *invite_data, uint16_t length,
+                                 void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_GROUP_INVITE,
+                                 .number = friend_number, .value = type };
+    twc_worker_push(data, &event, invite_data, length);
+}
+
+void
+twc_worker_group_message_callback(Tox *tox,
+                                  int32_t group_number, int32_t peer_number,
+                                  const uint8_t *message, uint16_t length,
+                                  void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_GROUP_MESSAGE,
+                                 .number = group_number,
+                                 .peer_number = peer_number };
+    twc_worker_push(data, &event, message, length);
+}
+
+void
+twc_worker_group_action_callback(Tox *tox,
+                                 int32_t group_number, int32_t peer_number,
+                                 const uint8_t *message, uint16_t length,
+                                 void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_GROUP_ACTION,
+                                 .number = group_number,
+                                 .peer_number = peer_number };
+    twc_worker_push(data, &event, message, length);
+}
+
+/**
+ * Record a group peer list change. The peer's name and key are looked up
+ * now, since a departing peer will be gone by the time the event is
+ * replayed.
+ */
+void
+twc_worker_group_namelist_change_callback(Tox *tox,
+                                          int group_number, int peer_number,
+                                          uint8_t change_type,
+                                          void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_GROUP_NAMELIST_CHANGE,
+                                 .number = group_number,
+                                 .peer_number = peer_number,
+                                 .value = change_type };
+    event.has_public_key = tox_group_peer_pubkey(tox, group_number,
+                                                 peer_number,
+                                                 event.public_key) == 0;
+
+    uint8_t name[TOX_MAX_NAME_LENGTH];
+    int length = tox_group_peername(tox, group_number, peer_number, name);
+
+    // store the name with its terminating null byte; an empty payload means
+    // the name is unknown
+    uint8_t name_nt[TOX_MAX_NAME_LENGTH + 1];
+    if (length >= 0)
+    {
+        memcpy(name_nt, name, length);
+        name_nt[length] = 0;
+    }
+    twc_worker_push(data, &event, name_nt, length >= 0 ? length + 1 : 0);
+}
+
+void
+twc_worker_group_title_callback(Tox *tox,
+                                int group_number, int peer_number,
+                                const uint8_t *title, uint8_t length,
+                                void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_GROUP_TITLE,
+                                 .number = group_number,
+                                 .peer_number = peer_number };
+    twc_worker_push(data, &event, title, length);
+}
+
+void
+twc_worker_self_connection_status_callback(Tox *tox, TOX_CONNECTION status,
+                                           void *data)
+{
+    struct t_twc_event event = { .type = TWC_EVENT_SELF_CONNECTION_STATUS,
+                                 .value = status };
+    twc_worker_push(data, &event, NULL, 0);
+}
+
+/**
+ * Replay an event on the main thread and free its data.
+ */
+void
+twc_worker_dispatch_event(struct t_twc_profile *profile,
+                          struct t_twc_event *event)
+{
+    Tox *tox = profile->tox;
+
+    switch (event->type)
+    {
+        case TWC_EVENT_FRIEND_MESSAGE:
+            twc_friend_message_callback(tox, event->number, event->value,
+                                        event->data, event->length, profile);
+            break;
+        case TWC_EVENT_FRIEND_CONNECTION_STATUS:
+            twc_connection_status_callback(tox, event->number, event->value,
+                                           profile);
+            break;
+        case TWC_EVENT_FRIEND_READ_RECEIPT:
+            twc_read_receipt_callback(tox, event->number,
+                                      (uint32_t)event->value, profile);
+            break;
+        case TWC_EVENT_FRIEND_NAME:
+            twc_name_change_callback(tox, event->number,
+                                     event->data, event->length, profile);
+            break;
+        case TWC_EVENT_FRIEND_STATUS:
+            twc_user_status_callback(tox, event->number, event->value,
+                                     profile);
+            break;
+        case TWC_EVENT_FRIEND_STATUS_MESSAGE:
+            twc_status_message_callback(tox, event->number,
+                                        event->data, event->length, profile);
+            break;
+        case TWC_EVENT_FRIEND_REQUEST:
+            twc_friend_request_callback(tox, event->public_key,
+                                        event->data, event->length, profile);
+            break;
+        case TWC_EVENT_GROUP_INVITE:
+            twc_group_invite_callback(tox, event->number, event->value,
+                                      event->data, event->length, profile);
+            break;
+        case TWC_EVENT_GROUP_MESSAGE:
+            twc_group_message_callback(tox, event->number, event->peer_number,
+                                       event->data, event->length, profile);
+            break;
+        case TWC_EVENT_GROUP_ACTION:
+            twc_group_action_callback(tox, event->number, event->peer_number,
+                                      event->data, event->length, profile);
+            break;
+        case TWC_EVENT_GROUP_NAMELIST_CHANGE:
+            twc_handle_group_namelist_change(profile, event->number,
+                                             event->value,
+                                             (char *)event->data,
+                                             event->has_public_key
+                                                 ? event->public_key : NULL);
+            break;
+        case TWC_EVENT_GROUP_TITLE:
+            twc_group_title_callback(tox, event->number, event->peer_number,
+                                     event->data, event->length, profile);
+            break;
+        case TWC_EVENT_SELF_CONNECTION_STATUS:
+            twc_self_connection_status_callback(tox, event->value, profile);
+            break;
+    }
+
+    free(event->data);
+}
+
+/**
+ * Take all events recorded by a worker, in order, and either replay or
+ * discard them.
+ */
+void
+twc_worker_drain(struct t_twc_worker *worker, bool dispatch)
+{
+    size_t head = worker->ring_head;
+    size_t tail = __atomic_load_n(&worker->ring_tail, __ATOMIC_SEQ_CST);
+    for (; head != tail; ++head)
+    {
+        struct t_twc_event *event =
+            &worker->ring[head & (TWC_WORKER_RING_SIZE - 1)];
+        if (dispatch)
+            twc_worker_dispatch_event(worker->profile, event);
+        else
+            free(event->data);
+        __atomic_store_n(&worker->ring_head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    // the overflow list only holds events newer than anything in the ring
+    pthread_mutex_lock(&worker->overflow_mutex);
+    struct t_twc_event *event = worker->overflow_first;
+    worker->overflow_first = worker->overflow_last = NULL;
+    __atomic_store_n(&worker->overflowing, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&worker->overflow_mutex);
+
+    while (event)
+    {
+        struct t_twc_event *next_event = event->next_event;
+        if (dispatch)
+            twc_worker_dispatch_event(worker->profile, event);
+        else
+            free(event->data);
+        free(event);
+        event = next_event;
+    }
+}
+
+/**
+ * Called on the main thread when a worker has recorded events. Replays them
+ * with the Tox instance locked, so that the worker is between iterations.
+ */
+int
+twc_worker_pipe_callback(void *data, int fd)
+{
+    struct t_twc_worker *worker = data;
+
+    char buffer[64];
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+    __atomic_store_n(&worker->signalled, 0, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&worker->mutex);
+    twc_worker_drain(worker, true);
+    pthread_mutex_unlock(&worker->mutex);
+
+    return WEECHAT_RC_OK;
+}
+
+/**
+ * Worker thread main loop. Iterates the Tox instance at the interval it
+ * asks for until told to stop.
+ */
+void *
+twc_worker_run(void *data)
+{
+    struct t_twc_worker *worker = data;
+    struct t_twc_profile *profile = worker->profile;
+    struct t_twc_scheduler_entry *schedule = &profile->schedule;
+
+    while (!__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&worker->mutex);
+
+        int64_t now = twc_scheduler_now();
+        twc_scheduler_count_iteration(schedule, now);
+        schedule->interval = twc_profile_iterate(profile);
+        if (schedule->interval < 1)
+            schedule->interval = 1;
+        schedule->deadline = now + schedule->interval * 1000;
+
+        pthread_mutex_unlock(&worker->mutex);
+
+        // sleep until the deadline, or until woken up
+        struct timespec wakeup = {
+            .tv_sec = schedule->deadline / 1000000,
+            .tv_nsec = (schedule->deadline % 1000000) * 1000 };
+        pthread_mutex_lock(&worker->wake_mutex);
+        while (!worker->woken
+               && !__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)
+               && pthread_cond_timedwait(&worker->wake_cond,
+                                         &worker->wake_mutex,
+                                         &wakeup) == 0);
+        worker->woken = false;
+        pthread_mutex_unlock(&worker->wake_mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * Set up a pipe for waking the main thread, with non-blocking ends.
+ */
+enum t_twc_rc
+twc_worker_open_pipe(struct t_twc_worker *worker)
+{
+    if (pipe(worker->pipe) != 0)
+        return TWC_RC_ERROR;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        fcntl(worker->pipe[i], F_SETFL,
+              fcntl(worker->pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(worker->pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Destroy a worker's mutexes and condition variable.
+ */
+void
+twc_worker_destroy_sync(struct t_twc_worker *worker)
+{
+    pthread_mutex_destroy(&worker->mutex);
+    pthread_mutex_destroy(&worker->overflow_mutex);
+    pthread_mutex_destroy(&worker->wake_mutex);
+    pthread_cond_destroy(&worker->wake_cond);
+}
+
+/**
+ * Move a loaded profile's Tox instance to a worker thread. Tox callbacks are
+ * recorded on the thread and replayed on the main thread.
+ */
+enum t_twc_rc
+twc_worker_start(struct t_twc_profile *profile)
+{
+    struct t_twc_worker *worker = calloc(1, sizeof(struct t_twc_worker));
+    if (!worker)
+        return TWC_RC_ERROR_MALLOC;
+
+    worker->profile = profile;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&worker->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&worker->overflow_mutex, NULL);
+    pthread_mutex_init(&worker->wake_mutex, NULL);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&worker->wake_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    if (twc_worker_open_pipe(worker) != TWC_RC_OK)
+    {
+        twc_worker_destroy_sync(worker);
+        free(worker);
+        return TWC_RC_ERROR;
+    }
+
+    worker->pipe_hook = weechat_hook_fd(worker->pipe[0], 1, 0, 0,
+                                        twc_worker_pipe_callback, worker);
+
+    Tox *tox = profile->tox;
+    tox_callback_friend_message(tox, twc_worker_friend_message_callback, worker);
+    tox_callback_friend_connection_status(tox, twc_worker_connection_status_callback, worker);
+    tox_callback_friend_read_receipt(tox, twc_worker_read_receipt_callback, worker);
+    tox_callback_friend_name(tox, twc_worker_name_change_callback, worker);
+    tox_callback_friend_status(tox, twc_worker_user_status_callback, worker);
+    tox_callback_friend_status_message(tox, twc_worker_status_message_callback, worker);
+    tox_callback_friend_request(tox, twc_worker_friend_request_callback, worker);
+    tox_callback_group_invite(tox, twc_worker_group_invite_callback, worker);
+    tox_callback_group_message(tox, twc_worker_group_message_callback, worker);
+    tox_callback_group_action(tox, twc_worker_group_action_callback, worker);
+    tox_callback_group_namelist_change(tox, twc_worker_group_namelist_change_callback, worker);
+    tox_callback_group_title(tox, twc_worker_group_title_callback, worker);
+    tox_callback_self_connection_status(tox, twc_worker_self_connection_status_callback, worker);
+
+    twc_scheduler_reset(profile);
+    profile->worker = worker;
+    if (pthread_create(&worker->thread, NULL, twc_worker_run, worker) != 0)
+    {
+        profile->worker = NULL;
+        weechat_unhook(worker->pipe_hook);
+        close(worker->pipe[0]);
+        close(worker->pipe[1]);
+        twc_worker_destroy_sync(worker);
+        free(worker);
+        return TWC_RC_ERROR;
+    }
+
+    return TWC_RC_OK;
+}
+
+/**
+ * Stop a profile's worker thread, if any. Events it recorded but that have
+ * not been replayed yet are discarded.
+ */
+void
+twc_worker_stop(struct t_twc_profile *profile)
+{
+    struct t_twc_worker *worker = profile->worker;
+    if (!worker)
+        return;
+
+    __atomic_store_n(&worker->stop, 1, __ATOMIC_RELEASE);
+    twc_worker_wake(profile);
+    pthread_join(worker->thread, NULL);
+    profile->worker = NULL;
+
+    weechat_unhook(worker->pipe_hook);
+    twc_worker_drain(worker, false);
+    close(worker->pipe[0]);
+    close(worker->pipe[1]);
+    twc_worker_destroy_sync(worker);
+    free(worker);
+}
+
+/**
+ * Make a profile's worker thread iterate now rather than at its deadline.
+ */
+void
+twc_worker_wake(struct t_twc_profile *profile)
+{
+    struct t_twc_worker *worker = profile->worker;
+    if (!worker)
+        return;
+
+    pthread_mutex_lock(&worker->wake_mutex);
+    worker->woken = true;
+    pthread_cond_signal(&worker->wake_cond);
+    pthread_mutex_unlock(&worker->wake_mutex);
+}
+
+/**
+ * Lock a profile's Tox instance against its worker thread. Does nothing if
+ * the profile is not threaded. May be nested.
+ */
+void
+twc_worker_lock(struct t_twc_profile *profile)
+{
+    if (profile->worker)
+        pthread_mutex_lock(&profile->worker->mutex);
+}
+
+/**
+ * Undo twc_worker_lock.
+ */
+void
+twc_worker_unlock(struct t_twc_profile *profile)
+{
+    if (profile->worker)
+        pthread_mutex_unlock(&profile->worker->mutex);
+}
+
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2015 Håvard Pettersson <mail@haavard.me>
+ *
+ * This file is part of Tox-WeeChat.
+ *
+ * Tox-WeeChat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox-WeeChat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox-WeeChat.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TOX_WEECHAT_WORKER_H
+#define TOX_WEECHAT_WORKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <tox/tox.h>
+
+#include "twc.h"
+
+struct t_twc_profile;
+
+#define TWC_WORKER_RING_SIZE 1024
+
+enum t_twc_event_type
+{
+    TWC_EVENT_FRIEND_MESSAGE,
+    TWC_EVENT_FRIEND_CONNECTION_STATUS,
+    TWC_EVENT_FRIEND_READ_RECEIPT,
+    TWC_EVENT_FRIEND_NAME,
+    TWC_EVENT_FRIEND_STATUS,
+    TWC_EVENT_FRIEND_STATUS_MESSAGE,
+    TWC_EVENT_FRIEND_REQUEST,
+    TWC_EVENT_GROUP_INVITE,
+    TWC_EVENT_GROUP_MESSAGE,
+    TWC_EVENT_GROUP_ACTION,
+    TWC_EVENT_GROUP_NAMELIST_CHANGE,
+    TWC_EVENT_GROUP_TITLE,
+    TWC_EVENT_SELF_CONNECTION_STATUS,
+};
+
+/**
+ * A Tox callback recorded on a worker thread, to be replayed on the main
+ * thread. number is a friend or group number, value holds the callback's
+ * small integer argument (message type, status, change type...), and data is
+ * an owned copy of its byte string, if any.
+ */
+struct t_twc_event
+{
+    enum t_twc_event_type type;
+    uint32_t number;
+    int32_t peer_number;
+    int value;
+
+    bool has_public_key;
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+
+    uint8_t *data;
+    size_t length;
+
+    struct t_twc_event *next_event;
+};
+
+/**
+ * A thread running tox_iterate for one profile.
+ *
+ * The Tox instance is guarded by mutex: the thread holds it while iterating
+ * and the main thread holds it whenever it calls into Tox. Callbacks fired
+ * on the thread are recorded in a single-producer single-consumer ring (or,
+ * if it is full, an overflow list) and the main thread is woken through a
+ * pipe to replay them.
+ *
+ * Events are recorded during tox_iterate and replayed with the Tox instance
+ * locked, so the ring itself is only ever used under mutex and its atomic
+ * indices are not what makes it safe. The atomics matter for signalled,
+ * which the pipe callback clears before taking mutex, and for stop. The main
+ * thread does not take mutex for anything it can serve from its own caches
+ * (the roster, the profile's own name and status).
+ */
+struct t_twc_worker
+{
+    struct t_twc_profile *profile;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    int stop;
+
+    struct t_twc_event ring[TWC_WORKER_RING_SIZE];
+    size_t ring_head;
+    size_t ring_tail;
+
+    pthread_mutex_t overflow_mutex;
+    int overflowing;
+    struct t_twc_event *overflow_first;
+    struct t_twc_event *overflow_last;
+
+    int signalled;
+    int pipe[2];
+    struct t_hook *pipe_hook;
+
+    pthread_mutex_t wake_mutex;
+    pthread_cond_t wake_cond;
+    bool woken;
+};
+
+enum t_twc_rc
+twc_worker_start(struct t_twc_profile *profile);
+
+void
+twc_worker_stop(struct t_twc_profile *profile);
+
+void
+twc_worker_wake(struct t_twc_profile *profile);
+
+void
+twc_worker_lock(struct t_twc_profile *profile);
+
+void
+twc_worker_unlock(struct t_twc_profile *profile);
+
+#endif // TOX_WEECHAT_WORKER_H
+
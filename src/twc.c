@@ -22,10 +22,12 @@
 #include <weechat/weechat-plugin.h>
 
 #include "twc-profile.h"
+#include "twc-chat.h"
 #include "twc-commands.h"
 #include "twc-gui.h"
 #include "twc-config.h"
 #include "twc-completion.h"
+#include "twc-scheduler.h"
 
 #include "twc.h"
 
@@ -43,6 +45,8 @@ weechat_plugin_init(struct t_weechat_plugin *plugin, int argc, char *argv[])
     weechat_plugin = plugin;
 
     twc_profile_init();
+    twc_chat_init();
+    twc_scheduler_init();
     twc_commands_init();
     twc_gui_init();
     twc_completion_init();
@@ -71,6 +75,9 @@ weechat_plugin_end(struct t_weechat_plugin *plugin)
     twc_config_write();
 
     twc_profile_free_all();
+    twc_scheduler_end();
+    twc_chat_end();
+    twc_gui_end();
 
     return WEECHAT_RC_OK;
 }
@@ -30,6 +30,12 @@ enum t_twc_rc
     TWC_RC_ERROR,
     /// Malloc error return code.
     TWC_RC_ERROR_MALLOC,
+    /// Queue full return code.
+    TWC_RC_ERROR_FULL,
+    /// Too large for the queue return code.
+    TWC_RC_ERROR_TOO_LARGE,
+    /// Message dropped by overflow policy return code.
+    TWC_RC_DROPPED,
 };
 
 #endif // TOX_WEECHAT_H